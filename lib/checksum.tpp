@@ -7,6 +7,14 @@
 #ifndef WAVED_CHECKSUM_TPP
 #define WAVED_CHECKSUM_TPP
 
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#ifdef __ARM_FEATURE_CRC32
+#include <arm_acle.h>
+#endif // __ARM_FEATURE_CRC32
+
 namespace Waved
 {
 
@@ -70,7 +78,90 @@ std::uint8_t basic_checksum(Iterator start, Iterator end)
     return result;
 }
 
-/** Compute a CRC-32 checksum on the given range. */
+/**
+ * Lookup tables for computing CRC32 checksums eight bytes at a time
+ * (“slicing-by-8”). Table `k` gives the contribution of a byte followed
+ * by `k` zero bytes.
+ */
+struct crc32_slices
+{
+    std::uint32_t values[8][256];
+};
+
+constexpr auto make_crc32_slices() -> crc32_slices
+{
+    crc32_slices result{};
+
+    for (std::size_t i = 0; i < 256; ++i) {
+        result.values[0][i] = crc32_table[i];
+    }
+
+    for (std::size_t k = 1; k < 8; ++k) {
+        for (std::size_t i = 0; i < 256; ++i) {
+            const auto previous = result.values[k - 1][i];
+            result.values[k][i] = crc32_table[previous & 0xFF]
+                ^ (previous >> 8);
+        }
+    }
+
+    return result;
+}
+
+constexpr crc32_slices crc32_sliced_table = make_crc32_slices();
+
+/** Read a little-endian 32-bit word from a byte range. */
+inline std::uint32_t crc32_load_word(const std::uint8_t* bytes)
+{
+    return std::uint32_t{bytes[0]}
+        | std::uint32_t{bytes[1]} << 8
+        | std::uint32_t{bytes[2]} << 16
+        | std::uint32_t{bytes[3]} << 24;
+}
+
+/**
+ * Update a CRC32 register with a contiguous range of bytes, using
+ * the CRC32 instructions if the target has them or slicing-by-8
+ * otherwise.
+ */
+inline std::uint32_t crc32_update(
+    std::uint32_t c, const std::uint8_t* it, const std::uint8_t* end
+)
+{
+#ifdef __ARM_FEATURE_CRC32
+    for (; end - it >= 4; it += 4) {
+        c = __crc32w(c, crc32_load_word(it));
+    }
+
+    for (; it != end; ++it) {
+        c = __crc32b(c, *it);
+    }
+#else
+    const auto& t = crc32_sliced_table.values;
+
+    for (; end - it >= 8; it += 8) {
+        const auto low = crc32_load_word(it) ^ c;
+        const auto high = crc32_load_word(it + 4);
+
+        c = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF]
+            ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24]
+            ^ t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF]
+            ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+    }
+
+    for (; it != end; ++it) {
+        c = crc32_table[(c ^ *it) & 0xFF] ^ (c >> 8);
+    }
+#endif // __ARM_FEATURE_CRC32
+
+    return c;
+}
+
+/**
+ * Compute a CRC-32 checksum on the given range.
+ *
+ * Ranges of pointers to bytes take a faster path that processes
+ * several bytes at a time.
+ */
 template<typename Iterator>
 std::uint32_t crc32_checksum(
     std::uint32_t initial, Iterator start, Iterator end
@@ -78,8 +169,19 @@ std::uint32_t crc32_checksum(
 {
     std::uint32_t c = initial ^ 0xFFFFFFFF;
 
-    for (auto it = start; it != end; ++it) {
-        c = crc32_table[(c ^ (*it)) & 0xFF] ^ (c >> 8);
+    if constexpr (
+        std::is_pointer_v<Iterator>
+        && sizeof(std::remove_pointer_t<Iterator>) == 1
+    ) {
+        c = crc32_update(
+            c,
+            reinterpret_cast<const std::uint8_t*>(start),
+            reinterpret_cast<const std::uint8_t*>(end)
+        );
+    } else {
+        for (auto it = start; it != end; ++it) {
+            c = crc32_table[(c ^ (*it)) & 0xFF] ^ (c >> 8);
+        }
     }
 
     return c ^ 0xFFFFFFFF;
@@ -87,4 +189,4 @@ std::uint32_t crc32_checksum(
 
 } // namespace Waved
 
-#endif // WAVED_CHECKSUM_HPP
+#endif // WAVED_CHECKSUM_TPP
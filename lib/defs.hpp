@@ -8,7 +8,10 @@
 #define WAVED_DEFS_HPP
 
 #include <array>
+#include <cstddef>
 #include <cstdint>
+#include <iterator>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -40,22 +43,162 @@ enum class Phase : std::uint8_t
 using Intensity = std::uint8_t;
 constexpr std::uint8_t intensity_values = 1 << 5;
 
+/**
+ * Pixel formats accepted for update buffers.
+ */
+enum class PixelFormat
+{
+    // One `Intensity` value per byte
+    Intensity,
+
+    // One 8-bit gray value per byte, from 0 (black) to 255 (white)
+    Y8,
+
+    // One little-endian RGB565 value per two bytes
+    RGB565,
+};
+
 /**
  * Phase matrix.
  *
  * Lookup table that gives the appropriate phase to apply to transition
- * between two intensities.
+ * between two intensities. Phases are packed at 2 bits each, so that a
+ * whole matrix fits in 256 bytes.
  */
-using PhaseMatrix
-    = std::array<std::array<Phase, intensity_values>, intensity_values>;
+class PhaseMatrix
+{
+public:
+    /** Get the phase to apply to transition between two intensities. */
+    Phase get(Intensity from, Intensity to) const
+    {
+        return static_cast<Phase>(
+            (this->words[from * 2 + (to >> 4)] >> ((to & 15) * 2)) & 3
+        );
+    }
+
+    /** Set the phase to apply to transition between two intensities. */
+    void set(Intensity from, Intensity to, Phase phase)
+    {
+        auto& word = this->words[from * 2 + (to >> 4)];
+        const auto shift = (to & 15) * 2;
+        word = (word & ~(std::uint32_t{3} << shift))
+            | (static_cast<std::uint32_t>(phase) << shift);
+    }
+
+    bool operator==(const PhaseMatrix& other) const
+    {
+        return this->words == other.words;
+    }
+
+    bool operator!=(const PhaseMatrix& other) const
+    {
+        return this->words != other.words;
+    }
+
+    // Packed phases: each source intensity uses two words, the first one
+    // for target intensities 0-15 and the second one for 16-31, starting
+    // from the least significant bits
+    std::array<std::uint32_t, intensity_values * 2> words{};
+};
 
 /**
  * Waveform.
  *
  * A waveform is a sequence of phase matrices used to transition an EPD cell
- * from a given grayscale intensity to another.
+ * from a given grayscale intensity to another. Identical matrices are
+ * shared between the waveforms of a table: a waveform only refers to them
+ * and keeps the storage they belong to alive.
  */
-using Waveform = std::vector<PhaseMatrix>;
+class Waveform
+{
+public:
+    /** Iterator over the matrices of a waveform. */
+    class const_iterator
+    {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = PhaseMatrix;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const PhaseMatrix*;
+        using reference = const PhaseMatrix&;
+
+        explicit const_iterator(const PhaseMatrix* const* frame)
+        : frame(frame)
+        {}
+
+        reference operator*() const { return **this->frame; }
+        pointer operator->() const { return *this->frame; }
+
+        const_iterator& operator++()
+        {
+            ++this->frame;
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            auto result = *this;
+            ++this->frame;
+            return result;
+        }
+
+        bool operator==(const const_iterator& other) const
+        {
+            return this->frame == other.frame;
+        }
+
+        bool operator!=(const const_iterator& other) const
+        {
+            return this->frame != other.frame;
+        }
+
+    private:
+        const PhaseMatrix* const* frame;
+    };
+
+    /** Create an empty waveform. */
+    Waveform() = default;
+
+    /**
+     * Create a waveform from shared matrices.
+     *
+     * @param frames Matrix to use in each frame.
+     * @param storage Owner of the matrices.
+     */
+    Waveform(
+        std::vector<const PhaseMatrix*> frames,
+        std::shared_ptr<const void> storage
+    )
+    : frames(std::move(frames))
+    , storage(std::move(storage))
+    {}
+
+    /** Get the matrix to use in a given frame. */
+    const PhaseMatrix& operator[](std::size_t frame) const
+    {
+        return *this->frames[frame];
+    }
+
+    std::size_t size() const { return this->frames.size(); }
+    bool empty() const { return this->frames.empty(); }
+
+    const_iterator begin() const
+    {
+        return const_iterator{this->frames.data()};
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator{this->frames.data() + this->frames.size()};
+    }
+
+private:
+    // Matrix used in each frame
+    std::vector<const PhaseMatrix*> frames;
+
+    // Keeps the matrices alive
+    std::shared_ptr<const void> storage;
+};
 
 /** Screen region. */
 struct Region
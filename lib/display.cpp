@@ -5,7 +5,11 @@
  */
 
 #include "display.hpp"
+#include "pipeline.hpp"
 #include <system_error>
+#include <algorithm>
+#include <array>
+#include <iterator>
 #include <chrono>
 #include <cstring>
 #include <cmath>
@@ -14,11 +18,22 @@
 #include <filesystem>
 #include <iostream>
 #include <iomanip>
+#include <string_view>
+#include <type_traits>
 #include <unistd.h>
 #include <fcntl.h>
 #include <linux/fb.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <sched.h>
+
+// Use the NEON code paths only if the target actually supports them
+#if defined(ENABLE_NEON) && defined(__ARM_NEON)
+#define USE_NEON
+#include <arm_neon.h>
+#endif // ENABLE_NEON && __ARM_NEON
 
 namespace fs = std::filesystem;
 namespace chrono = std::chrono;
@@ -29,56 +44,478 @@ namespace
 constexpr int fbioblank_off = FB_BLANK_POWERDOWN;
 constexpr int fbioblank_on = FB_BLANK_UNBLANK;
 
-void copy_rect(
-    const Waved::Intensity* source,
-    const Waved::Region& source_region,
-    std::uint32_t source_width,
+#ifndef DRY_RUN
+/**
+ * Restrict a thread to run on a set of CPU cores, or leave it unchanged
+ * if the set is empty.
+ */
+void set_affinity(
+    std::thread& thread,
+    const std::vector<unsigned>& cpus,
+    const char* name
+)
+{
+    if (cpus.empty()) {
+        return;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    for (auto cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+
+    const int error = pthread_setaffinity_np(
+        thread.native_handle(), sizeof(set), &set
+    );
+
+    if (error != 0) {
+        std::cerr << "[waved] Cannot set CPU affinity of " << name
+            << " thread: " << std::strerror(error) << '\n';
+    }
+}
+#endif // DRY_RUN
+
+/**
+ * Compute the parts of a region that are not covered by another region.
+ *
+ * @param region Region to subtract from.
+ * @param hole Region to subtract.
+ * @return Up to four disjoint regions covering `region` minus `hole`.
+ */
+std::vector<Waved::Region> subtract_region(
+    const Waved::Region& region,
+    const Waved::Region& hole
+)
+{
+    if (region.width == 0 || region.height == 0) {
+        return {};
+    }
+
+    auto top = std::max(region.top, hole.top);
+    auto left = std::max(region.left, hole.left);
+    auto bottom = std::min(region.top + region.height, hole.top + hole.height);
+    auto right = std::min(region.left + region.width, hole.left + hole.width);
+
+    if (top >= bottom || left >= right) {
+        return {region};
+    }
+
+    std::vector<Waved::Region> result;
+
+    if (region.top < top) {
+        result.push_back(Waved::Region{
+            region.top, region.left,
+            region.width, top - region.top
+        });
+    }
+
+    if (bottom < region.top + region.height) {
+        result.push_back(Waved::Region{
+            bottom, region.left,
+            region.width, region.top + region.height - bottom
+        });
+    }
+
+    if (region.left < left) {
+        result.push_back(Waved::Region{
+            top, region.left,
+            left - region.left, bottom - top
+        });
+    }
+
+    if (right < region.left + region.width) {
+        result.push_back(Waved::Region{
+            top, right,
+            region.left + region.width - right, bottom - top
+        });
+    }
+
+    return result;
+}
+
+/** Check whether two regions share at least one cell. */
+bool intersects(const Waved::Region& a, const Waved::Region& b)
+{
+    return (
+        a.top < b.top + b.height && b.top < a.top + a.height
+        && a.left < b.left + b.width && b.left < a.left + a.width
+    );
+}
+
+/** Compute the region shared by two intersecting regions. */
+Waved::Region intersection(const Waved::Region& a, const Waved::Region& b)
+{
+    auto top = std::max(a.top, b.top);
+    auto left = std::max(a.left, b.left);
+    auto width = std::min(a.left + a.width, b.left + b.width) - left;
+    auto height = std::min(a.top + a.height, b.top + b.height) - top;
+    return Waved::Region{top, left, width, height};
+}
+
+/**
+ * Compute the parts of a region that are not covered by any of a list
+ * of regions.
+ */
+std::vector<Waved::Region> subtract_regions(
+    const Waved::Region& region,
+    const std::vector<Waved::Region>& holes
+)
+{
+    std::vector<Waved::Region> result{region};
+
+    for (const auto& hole : holes) {
+        std::vector<Waved::Region> next;
+
+        for (const auto& part : result) {
+            auto parts = subtract_region(part, hole);
+            next.insert(next.end(), parts.cbegin(), parts.cend());
+        }
+
+        result = std::move(next);
+    }
+
+    return result;
+}
+
+/** Compute the smallest region containing two regions. */
+Waved::Region bounding_box(const Waved::Region& a, const Waved::Region& b)
+{
+    auto top = std::min(a.top, b.top);
+    auto left = std::min(a.left, b.left);
+    auto width = std::max(a.left + a.width, b.left + b.width) - left;
+    auto height = std::max(a.top + a.height, b.top + b.height) - top;
+    return Waved::Region{top, left, width, height};
+}
+
+/** Convert an 8-bit gray value to the nearest even intensity. */
+constexpr Waved::Intensity y8_to_intensity(std::uint8_t value)
+{
+    return static_cast<Waved::Intensity>((value * 15 + 127) / 255 * 2);
+}
+
+/** Convert an RGB565 value to an even intensity based on its luma. */
+constexpr Waved::Intensity rgb565_to_intensity(std::uint16_t value)
+{
+    // 0.21 R + 0.72 G + 0.07 B, with each channel normalized to 1,
+    // computed exactly with a common denominator of 100 × 31 × 63
+    const std::uint32_t red = (value >> 11) & 31;
+    const std::uint32_t green = (value >> 5) & 63;
+    const std::uint32_t blue = value & 31;
+    const std::uint32_t luma = 1323 * red + 2232 * green + 441 * blue;
+    return static_cast<Waved::Intensity>(luma * 15 / 195300 * 2);
+}
+
+/** Convert an RGB565 value to the nearest 8-bit gray value of its luma. */
+constexpr std::uint8_t rgb565_to_y8(std::uint16_t value)
+{
+    const std::uint32_t red = (value >> 11) & 31;
+    const std::uint32_t green = (value >> 5) & 63;
+    const std::uint32_t blue = value & 31;
+    const std::uint32_t luma = 1323 * red + 2232 * green + 441 * blue;
+    return static_cast<std::uint8_t>((luma * 255 + 97650) / 195300);
+}
+
+/** Table giving a converted value for each RGB565 value. */
+template<typename T>
+using RGB565Table = std::array<T, 1 << 16>;
+
+/**
+ * Get the table of the even intensities of RGB565 values, which is built
+ * the first time it is needed.
+ */
+auto get_rgb565_intensities() -> const RGB565Table<Waved::Intensity>&
+{
+    static const auto table = [] {
+        RGB565Table<Waved::Intensity> result;
+
+        for (std::size_t value = 0; value < result.size(); ++value) {
+            result[value] = rgb565_to_intensity(value);
+        }
+
+        return result;
+    }();
+
+    return table;
+}
+
+/**
+ * Get the table of the 8-bit gray values of RGB565 values, which is built
+ * the first time it is needed.
+ */
+auto get_rgb565_grays() -> const RGB565Table<std::uint8_t>&
+{
+    static const auto table = [] {
+        RGB565Table<std::uint8_t> result;
+
+        for (std::size_t value = 0; value < result.size(); ++value) {
+            result[value] = rgb565_to_y8(value);
+        }
+
+        return result;
+    }();
+
+    return table;
+}
+
+// Thresholds of the 4 × 4 Bayer matrix used for ordered dithering
+constexpr std::size_t dither_size = 4;
+constexpr std::uint8_t dither_matrix[dither_size][dither_size] = {
+    { 0,  8,  2, 10},
+    {12,  4, 14,  6},
+    { 3, 11,  1,  9},
+    {15,  7, 13,  5},
+};
+
+/** Get the number of evenly spaced gray levels that a mode can display. */
+constexpr std::uint32_t get_mode_levels(Waved::ModeKind kind)
+{
+    switch (kind) {
+    case Waved::ModeKind::DU:
+    case Waved::ModeKind::A2:
+        return 2;
+
+    case Waved::ModeKind::DU4:
+        return 4;
+
+    default:
+        return 16;
+    }
+}
+
+/**
+ * Quantize an 8-bit gray value to one of the evenly spaced levels of
+ * a mode, rounding up when the fractional part exceeds a threshold.
+ *
+ * @param value Gray value, from 0 (black) to 255 (white).
+ * @param levels Number of levels, including black and white.
+ * @param threshold Dither threshold, from 0 to 15.
+ * @return Intensity of the chosen level.
+ */
+constexpr Waved::Intensity dither_y8(
+    std::uint8_t value,
+    std::uint32_t levels,
+    std::uint8_t threshold
+)
+{
+    // Thresholds are centered in their sixteenths of a level
+    const std::uint32_t level = (
+        value * (levels - 1) * 32 + (threshold * 2 + 1) * 255
+    ) / (255 * 32);
+    return static_cast<Waved::Intensity>(
+        level * ((Waved::intensity_values - 2) / (levels - 1))
+    );
+}
+
+// Size of the square tiles in which regions are transformed, chosen so
+// that the source and destination rows of a tile stay in the cache
+constexpr std::size_t transform_tile = 32;
+
+/**
+ * Convert a rectangle of pixels from reMarkable coordinates to the display
+ * coordinates, transposing and flipping both axes.
+ *
+ * @param data Pointer to the first source pixel of the region.
+ * @param stride Number of bytes between the starts of two source rows.
+ * @param region Source region, in reMarkable coordinates.
+ * @param dest Destination buffer, with `region.height` cells per row.
+ * @param convert Function that converts a source pixel to an intensity,
+ * optionally given the destination row and column of the pixel.
+ * @param rows Range of destination rows to convert.
+ * @param cols Range of destination columns to convert.
+ */
+template<std::size_t PixelSize, typename Convert>
+inline void transform_rect(
+    const std::uint8_t* data,
+    std::size_t stride,
+    const Waved::Region& region,
     Waved::Intensity* dest,
-    std::uint32_t dest_top,
-    std::uint32_t dest_left,
-    std::uint32_t dest_width
+    Convert convert,
+    std::pair<std::size_t, std::size_t> rows,
+    std::pair<std::size_t, std::size_t> cols
 )
 {
-    source += source_region.left + source_width * source_region.top;
-    dest += dest_left + dest_width * dest_top;
+    for (std::size_t c = cols.first; c < cols.second; ++c) {
+        const std::uint8_t* source = data
+            + (region.height - c - 1) * stride
+            + (region.width - rows.first - 1) * PixelSize;
+        Waved::Intensity* target = dest + rows.first * region.height + c;
+
+        for (std::size_t r = rows.first; r < rows.second; ++r) {
+            if constexpr (std::is_invocable_v<
+                Convert, const std::uint8_t*, std::size_t, std::size_t
+            >) {
+                *target = convert(source, r, c);
+            } else {
+                *target = convert(source);
+            }
 
-    for (std::uint32_t y = 0; y < source_region.height; ++y) {
-        std::copy(source, source + source_region.width, dest);
-        source += source_width;
-        dest += dest_width;
+            source -= PixelSize;
+            target += region.height;
+        }
     }
 }
 
-#ifdef ENABLE_PERF_REPORT
-std::ostream& operator<<(std::ostream& out, chrono::steady_clock::time_point t)
+/**
+ * Convert the pixels of a region from reMarkable coordinates to the display
+ * coordinates, transposing and flipping both axes.
+ *
+ * @param data Pointer to the first source pixel of the region.
+ * @param stride Number of bytes between the starts of two source rows.
+ * @param region Source region, in reMarkable coordinates.
+ * @param dest Destination buffer, with `region.height` cells per row.
+ * @param convert Function that converts a source pixel to an intensity,
+ * optionally given the destination row and column of the pixel.
+ */
+template<std::size_t PixelSize, typename Convert>
+void transform_region(
+    const std::uint8_t* data,
+    std::size_t stride,
+    const Waved::Region& region,
+    Waved::Intensity* dest,
+    Convert convert
+)
 {
-    out << chrono::duration_cast<chrono::microseconds>(t.time_since_epoch())
-        .count();
-    return out;
+    // Destination rows correspond to source columns and vice versa
+    for (std::size_t r = 0; r < region.width; r += transform_tile) {
+        const auto r_end = std::min<std::size_t>(
+            r + transform_tile, region.width
+        );
+
+        for (std::size_t c = 0; c < region.height; c += transform_tile) {
+            const auto c_end = std::min<std::size_t>(
+                c + transform_tile, region.height
+            );
+
+            transform_rect<PixelSize>(
+                data, stride, region, dest, convert,
+                {r, r_end}, {c, c_end}
+            );
+        }
+    }
 }
-#endif // ENABLE_PERF_REPORT
 
-template<typename Elem>
-std::ostream& operator<<(std::ostream& out, const std::vector<Elem>& ts)
+#ifdef USE_NEON
+/**
+ * Convert the intensities of a region from reMarkable coordinates to the
+ * display coordinates, transposing and flipping both axes in blocks of
+ * 8 × 8 cells.
+ *
+ * @param data Pointer to the first source cell of the region.
+ * @param stride Number of bytes between the starts of two source rows.
+ * @param region Source region, in reMarkable coordinates.
+ * @param dest Destination buffer, with `region.height` cells per row.
+ */
+void transform_intensities_neon(
+    const std::uint8_t* data,
+    std::size_t stride,
+    const Waved::Region& region,
+    Waved::Intensity* dest
+)
 {
-    for (auto it = ts.cbegin(); it != ts.cend(); ++it) {
-        out << *it;
+    constexpr std::size_t block = 8;
+    const uint8x8_t mask = vdup_n_u8(Waved::intensity_values - 1);
+    const auto convert = [](const std::uint8_t* pixel) {
+        return static_cast<Waved::Intensity>(
+            *pixel & (Waved::intensity_values - 1)
+        );
+    };
 
-        if (std::next(it) != ts.cend()) {
-            out << ':';
+    // Part of the region covered by whole blocks
+    const std::size_t rows = region.width & ~(block - 1);
+    const std::size_t cols = region.height & ~(block - 1);
+
+    for (std::size_t r0 = 0; r0 < rows; r0 += transform_tile) {
+        const auto r_end = std::min(r0 + transform_tile, rows);
+
+        for (std::size_t c0 = 0; c0 < cols; c0 += transform_tile) {
+            const auto c_end = std::min(c0 + transform_tile, cols);
+
+            for (std::size_t r = r0; r < r_end; r += block) {
+                for (std::size_t c = c0; c < c_end; c += block) {
+                    // Load source rows in reverse order and reverse the
+                    // cells of each row, so that a plain transpose yields
+                    // the destination block
+                    const std::uint8_t* source = data
+                        + (region.height - c - 1) * stride
+                        + (region.width - r - block) * sizeof(Waved::Intensity);
+
+                    uint8x8_t in[block];
+
+                    for (std::size_t k = 0; k < block; ++k) {
+                        in[k] = vrev64_u8(vld1_u8(source));
+                        source -= stride;
+                    }
+
+                    uint8x8x2_t t8[4];
+
+                    for (std::size_t k = 0; k < 4; ++k) {
+                        t8[k] = vtrn_u8(in[2 * k], in[2 * k + 1]);
+                    }
+
+                    uint16x4x2_t t16[4];
+
+                    for (std::size_t k = 0; k < 2; ++k) {
+                        t16[2 * k] = vtrn_u16(
+                            vreinterpret_u16_u8(t8[2 * k].val[0]),
+                            vreinterpret_u16_u8(t8[2 * k + 1].val[0])
+                        );
+                        t16[2 * k + 1] = vtrn_u16(
+                            vreinterpret_u16_u8(t8[2 * k].val[1]),
+                            vreinterpret_u16_u8(t8[2 * k + 1].val[1])
+                        );
+                    }
+
+                    uint32x2x2_t t32[4];
+
+                    for (std::size_t k = 0; k < 2; ++k) {
+                        t32[k] = vtrn_u32(
+                            vreinterpret_u32_u16(t16[k].val[0]),
+                            vreinterpret_u32_u16(t16[k + 2].val[0])
+                        );
+                        t32[k + 2] = vtrn_u32(
+                            vreinterpret_u32_u16(t16[k].val[1]),
+                            vreinterpret_u32_u16(t16[k + 2].val[1])
+                        );
+                    }
+
+                    // Transposed rows 0 to 3 are in the first halves of the
+                    // results and rows 4 to 7 in their second halves
+                    Waved::Intensity* target = dest + r * region.height + c;
+
+                    for (std::size_t k = 0; k < 4; ++k) {
+                        vst1_u8(
+                            target + k * region.height,
+                            vand_u8(vreinterpret_u8_u32(t32[k].val[0]), mask)
+                        );
+                        vst1_u8(
+                            target + (k + 4) * region.height,
+                            vand_u8(vreinterpret_u8_u32(t32[k].val[1]), mask)
+                        );
+                    }
+                }
+            }
         }
     }
 
-    return out;
+    // Convert the remaining cells that are not covered by whole blocks
+    transform_rect<1>(
+        data, stride, region, dest, convert,
+        {0, rows}, {cols, region.height}
+    );
+    transform_rect<1>(
+        data, stride, region, dest, convert,
+        {rows, region.width}, {0, region.height}
+    );
 }
+#endif // USE_NEON
 
 }
 
 namespace Waved
 {
 
-Display::UpdateID Display::next_update_id = 0;
-
 Display::Display(
     const char* framebuffer_path,
     const char* temperature_sensor_path,
@@ -87,7 +524,20 @@ Display::Display(
 : table(std::move(waveform_table))
 , framebuffer_fd(framebuffer_path, O_RDWR)
 , temp_sensor_fd(temperature_sensor_path, O_RDONLY)
-{}
+, update_event_fd(eventfd(0, EFD_CLOEXEC))
+{
+    if (this->update_event_fd == -1) {
+        throw std::system_error(
+            errno,
+            std::generic_category(),
+            "Create update event"
+        );
+    }
+
+    for (std::size_t i = 0; i < update_ring_size; ++i) {
+        this->update_ring[i].sequence = i;
+    }
+}
 
 auto Display::discover_framebuffer() -> std::optional<std::string>
 {
@@ -148,9 +598,10 @@ Display::~Display()
 
 void Display::start()
 {
+    this->update_temperature(/* force = */ true);
+
 #ifndef DRY_RUN
     this->set_power(true);
-    this->update_temperature();
 
     if (
         ioctl(
@@ -212,6 +663,22 @@ void Display::start()
     }
 
     this->framebuffer = reinterpret_cast<std::uint8_t*>(mmap_res);
+
+    if (this->lock_memory) {
+        // Keep the frames and the state used to generate them resident,
+        // including the heap-allocated waveform tables, decoded waveforms
+        // and per-update lookup tables, as well as anything they allocate
+        // later on. A single call either locks everything or nothing
+        this->memory_locked = mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+
+        if (!this->memory_locked) {
+            std::cerr << "[waved] Cannot lock memory: "
+                << std::strerror(errno) << '\n';
+        }
+    }
+#else
+    this->dry_run_framebuffer.resize(buf_frame * buf_total_frames);
+    this->framebuffer = this->dry_run_framebuffer.data();
 #endif // DRY_RUN
 
     // Initialize the null frame
@@ -293,17 +760,53 @@ void Display::start()
         this->reset_frame(i);
     }
 
+    // Start the threads that help generating frames. These also serve
+    // when generating frames inline in dry-run mode
+    this->start_workers();
+
 #ifndef DRY_RUN
     // Start the processing threads
     this->stopping_generator = false;
     this->generator_thread = std::thread(&Display::run_generator_thread, this);
     pthread_setname_np(this->generator_thread.native_handle(), "waved_generator");
+    set_affinity(this->generator_thread, this->generator_cpus, "generator");
 
     this->stopping_vsync = false;
     this->vsync_thread = std::thread(&Display::run_vsync_thread, this);
     pthread_setname_np(this->vsync_thread.native_handle(), "waved_vsync");
+    set_affinity(this->vsync_thread, this->vsync_cpus, "vsync");
+
+    if (this->vsync_priority > 0) {
+        sched_param param{};
+        param.sched_priority = this->vsync_priority;
+
+        const int error = pthread_setschedparam(
+            this->vsync_thread.native_handle(),
+            SCHED_FIFO,
+            &param
+        );
+
+        if (error != 0) {
+            std::cerr << "[waved] Cannot set real-time priority of vsync "
+                "thread: " << std::strerror(error) << '\n';
+        }
+    }
+
+    this->stopping_temperature = false;
+
+    // A reading was just taken above
+    this->temperature_requested = false;
+    this->temperature_thread = std::thread(
+        &Display::run_temperature_thread, this
+    );
+    pthread_setname_np(this->temperature_thread.native_handle(), "waved_temp");
 #endif // DRY_RUN
 
+    {
+        std::lock_guard<std::mutex> lock(this->completion_lock);
+        this->stopping_completion = false;
+    }
+
     this->started = true;
 }
 
@@ -313,19 +816,55 @@ void Display::stop()
 #ifndef DRY_RUN
         // Wait for the current update to be processed then terminate
         this->stopping_generator = true;
-        this->updates_cv.notify_one();
+
+        const std::uint64_t event = 1;
+        write(this->update_event_fd, &event, sizeof(event));
+
+        {
+            std::lock_guard<std::mutex> lock(this->frames_lock);
+            this->slots_free_cv.notify_one();
+        }
+
         this->generator_thread.join();
 
         // Terminate the vsync thread
-        this->stopping_vsync = true;
+        {
+            std::lock_guard<std::mutex> lock(this->frames_lock);
+            this->stopping_vsync = true;
+            this->frames_ready_cv.notify_one();
+        }
+
         this->vsync_thread.join();
 
+        // Terminate the temperature thread
+        {
+            std::lock_guard<std::mutex> lock(this->temperature_lock);
+            this->stopping_temperature = true;
+        }
+
+        this->temperature_cv.notify_one();
+        this->temperature_thread.join();
+
+        if (this->memory_locked) {
+            munlockall();
+            this->memory_locked = false;
+        }
+
         if (this->framebuffer != nullptr) {
             munmap(this->framebuffer, this->fix_info.smem_len);
         }
 #endif // DRY_RUN
 
+        this->stop_workers();
         this->started = false;
+
+        // Updates remaining in the queue will never be displayed
+        {
+            std::lock_guard<std::mutex> lock(this->completion_lock);
+            this->stopping_completion = true;
+        }
+
+        this->completion_cv.notify_all();
     }
 
     this->set_power(false);
@@ -342,23 +881,33 @@ void Display::set_power(bool power_state)
             ) == 0
         ) {
             this->power_state = power_state;
+
+            {
+                // Take a fresh reading when powering on, since the panel
+                // temperature is not sampled while powered off
+                std::lock_guard<std::mutex> lock(this->temperature_lock);
+                this->temperature_powered = power_state;
+                this->temperature_requested = power_state;
+            }
+
+            this->temperature_cv.notify_one();
+
+            TraceEvent event;
+            event.type = power_state
+                ? TraceEventType::PowerOn
+                : TraceEventType::PowerOff;
+            event.time = TraceEvent::now();
+            this->trace.record(event);
         }
     }
 #endif // DRY_RUN
 }
 
-void Display::update_temperature()
+auto Display::read_temperature() -> int
 {
 #ifdef DRY_RUN
-    int result = 24;
+    return 24;
 #else
-    if (
-        chrono::steady_clock::now() - this->temperature_last_read
-        <= temperature_read_interval
-    ) {
-        return;
-    }
-
     char buffer[12];
     ssize_t size = 0;
 
@@ -386,456 +935,2599 @@ void Display::update_temperature()
         buffer[size] = '\0';
     }
 
-    int result = std::stoi(buffer);
+    return std::stoi(buffer);
 #endif // DRY_RUN
-    this->temperature = result;
-    this->temperature_last_read = chrono::steady_clock::now();
 }
 
-bool Display::push_update(
-    ModeKind mode,
-    Region region,
-    const std::vector<Intensity>& buffer
-)
+void Display::update_temperature(bool force)
 {
-    return this->push_update(this->table.get_mode_id(mode), region, buffer);
-}
+    int result = this->read_temperature();
+    this->temperature = result;
 
-bool Display::push_update(
-    ModeID mode,
-    Region region,
-    const std::vector<Intensity>& buffer
-)
-{
-    if (buffer.size() != region.width * region.height) {
-        return false;
+    const auto& temperatures = this->table.get_temperatures();
+
+    if (temperatures.size() < 2) {
+        throw std::out_of_range("No temperature available");
     }
 
-    // Transform from reMarkable coordinates to EPD coordinates:
-    // transpose to swap X and Y and flip X and Y
-    std::vector<Intensity> trans_buffer(buffer.size());
+    // Use the closest supported range outside of the operating temperatures
+    const int clamped = std::clamp(
+        result,
+        static_cast<int>(temperatures.front()),
+        static_cast<int>(temperatures.back()) - 1
+    );
 
-    for (std::size_t k = 0; k < buffer.size(); ++k) {
-        std::size_t i = region.height - (k % region.height) - 1;
-        std::size_t j = region.width - (k / region.height) - 1;
-        trans_buffer[k] = buffer[i * region.width + j] & (intensity_values - 1);
-    }
+    const std::size_t range = std::upper_bound(
+        temperatures.cbegin(), temperatures.cend(), clamped
+    ) - temperatures.cbegin();
 
-    region = Region{
-        /* top = */ epd_height - region.left - region.width,
-        /* left = */ epd_width - region.top - region.height,
-        /* width = */ region.height,
-        /* height = */ region.width
-    };
+    if (!force && range == this->temperature_range) {
+        return;
+    }
 
-    if (
-        region.left >= epd_width
-        || region.top >= epd_height
-        || region.left + region.width > epd_width
-        || region.top + region.height > epd_height
-    ) {
-        return false;
+    if (clamped != result) {
+        std::cerr << "[waved] Panel temperature " << result << " °C out of "
+            "the supported range, using " << clamped << " °C\n";
     }
 
-#ifndef DRY_RUN
-    std::lock_guard<std::mutex> lock(this->updates_lock);
-#endif // DRY_RUN
+    auto resolved = std::make_shared<ModeWaveforms>();
 
-    this->pending_updates.emplace(Update{
-        {this->next_update_id++}
-        , mode
-        , region
-        , std::move(trans_buffer)
-#ifdef ENABLE_PERF_REPORT
-        , /* queue_time = */ chrono::steady_clock::now()
-        , /* dequeue_time = */ chrono::steady_clock::now()
-        , /* generate_times = */ {}
-        , /* vsync_times = */ {}
-#endif // ENABLE_PERF_REPORT
-    });
+    for (ModeID mode = 0; mode < this->table.get_mode_count(); ++mode) {
+        resolved->push_back(this->table.lookup(mode, clamped));
+    }
 
-#ifndef DRY_RUN
-    this->updates_cv.notify_one();
-#else
-    this->process_update();
-#endif // DRY_RUN
-    return true;
-}
+    this->temperature_range = range;
 
-void Display::run_generator_thread()
-{
-    while (!this->stopping_generator) {
-        this->process_update();
+    {
+        std::lock_guard<std::mutex> lock(this->waveforms_lock);
+        this->waveforms = std::move(resolved);
     }
+
+    TraceEvent event;
+    event.type = TraceEventType::Temperature;
+    event.time = TraceEvent::now();
+    event.value = static_cast<std::uint32_t>(result);
+    this->trace.record(event);
 }
 
-void Display::process_update()
+auto Display::get_waveform(ModeID mode) -> std::shared_ptr<const Waveform>
 {
-    if (this->pop_update()) {
-        this->align_update();
-        this->generate_frames();
-        this->commit_update();
-    }
+    std::lock_guard<std::mutex> lock(this->waveforms_lock);
+    return (*this->waveforms)[mode];
 }
 
-bool Display::pop_update()
+void Display::run_temperature_thread()
 {
-#ifdef DRY_RUN
-    if (this->pending_updates.empty()) {
-        return false;
-    }
-#else
-    std::unique_lock<std::mutex> lock(this->updates_lock);
-    this->updates_cv.wait(lock, [this] {
-        return !this->pending_updates.empty() || this->stopping_generator;
-    });
+    std::unique_lock<std::mutex> lock(this->temperature_lock);
+
+    while (true) {
+        if (this->temperature_powered) {
+            this->temperature_cv.wait_for(
+                lock, temperature_read_interval,
+                [this] {
+                    return this->stopping_temperature
+                        || this->temperature_requested
+                        || !this->temperature_powered;
+                }
+            );
+        } else {
+            // The panel is not driven while the controller is off, so
+            // leave the sensor alone until it is powered on again
+            this->temperature_cv.wait(lock, [this] {
+                return this->stopping_temperature
+                    || this->temperature_powered;
+            });
+        }
 
-    if (this->stopping_generator) {
-        return false;
-    }
-#endif // DRY_RUN
+        if (this->stopping_temperature) {
+            return;
+        }
 
-    this->generate_update = std::move(this->pending_updates.front());
-    this->pending_updates.pop();
+        if (!this->temperature_powered) {
+            continue;
+        }
 
-    while (this->merge_update());
+        this->temperature_requested = false;
+        lock.unlock();
 
-#ifdef ENABLE_PERF_REPORT
-    this->generate_update.dequeue_time = chrono::steady_clock::now();
-#endif // ENABLE_PERF_REPORT
-    return true;
-}
+        try {
+            this->update_temperature();
+        } catch (const std::exception& err) {
+            // Don’t throw here, since we’re inside a background thread,
+            // keep using the last reading instead
+            std::cerr << "Update temperature: " << err.what() << '\n';
+        }
 
-auto Display::merge_update() -> bool
-{
-    if (this->pending_updates.empty()) {
-        return false;
+        lock.lock();
     }
+}
 
-    Update& cur_update = this->generate_update;
-    const Update& next_update = this->pending_updates.front();
-
-    if (cur_update.mode != next_update.mode) {
+auto Display::push_update(
+    ModeKind mode,
+    Region region,
+    const std::vector<Intensity>& buffer
+) -> std::optional<UpdateID>
+{
+    return this->push_update(this->table.get_mode_id(mode), region, buffer);
+}
+
+auto Display::push_update(
+    ModeID mode,
+    Region region,
+    const std::vector<Intensity>& buffer
+) -> std::optional<UpdateID>
+{
+    if (buffer.size() != region.width * region.height) {
+        return {};
+    }
+
+    return this->push_update(
+        mode, region,
+        buffer.data(), region.width * sizeof(Intensity),
+        PixelFormat::Intensity
+    );
+}
+
+auto Display::push_update(
+    ModeKind mode,
+    Region region,
+    const void* data,
+    std::size_t stride,
+    PixelFormat format
+) -> std::optional<UpdateID>
+{
+    return this->push_update(
+        this->table.get_mode_id(mode),
+        region, data, stride, format
+    );
+}
+
+auto Display::push_update(
+    ModeID mode,
+    Region region,
+    const void* data,
+    std::size_t stride,
+    PixelFormat format
+) -> std::optional<UpdateID>
+{
+    if (mode >= this->table.get_mode_count()) {
+        return {};
+    }
+
+    const auto trans_region = Display::to_display_region(region);
+
+    if (!trans_region) {
+        return {};
+    }
+
+    UpdateID position;
+    UpdateSlot* slot = this->claim_slot(position);
+
+    if (slot == nullptr) {
+        return {};
+    }
+
+    Update& update = slot->update;
+    update.id.assign(1, position);
+    update.mode = mode;
+    update.region = *trans_region;
+    update.compiled.reset();
+
+    const auto transform_start = this->trace.is_enabled()
+        ? TraceEvent::now()
+        : 0;
+
+    update.buffer.resize(region.width * region.height);
+    this->convert_pixels(
+        mode, region, *trans_region,
+        data, stride, format,
+        update.buffer.data()
+    );
+
+    this->publish_slot(*slot, position, transform_start);
+    return position;
+}
+
+auto Display::compile_update(
+    ModeKind mode,
+    Region region,
+    const void* data,
+    std::size_t stride,
+    PixelFormat format
+) -> std::shared_ptr<CompiledUpdate>
+{
+    return this->compile_update(
+        this->table.get_mode_id(mode),
+        region, data, stride, format
+    );
+}
+
+auto Display::compile_update(
+    ModeID mode,
+    Region region,
+    const void* data,
+    std::size_t stride,
+    PixelFormat format
+) -> std::shared_ptr<CompiledUpdate>
+{
+    if (mode >= this->table.get_mode_count()) {
+        return nullptr;
+    }
+
+    const auto trans_region = Display::to_display_region(region);
+
+    if (!trans_region) {
+        return nullptr;
+    }
+
+    std::shared_ptr<CompiledUpdate> result{new CompiledUpdate};
+    result->mode = mode;
+    result->region = *trans_region;
+    result->buffer.resize(region.width * region.height);
+    this->convert_pixels(
+        mode, region, *trans_region,
+        data, stride, format,
+        result->buffer.data()
+    );
+    return result;
+}
+
+auto Display::push_update(std::shared_ptr<CompiledUpdate> compiled)
+-> std::optional<UpdateID>
+{
+    if (!compiled) {
+        return {};
+    }
+
+    UpdateID position;
+    UpdateSlot* slot = this->claim_slot(position);
+
+    if (slot == nullptr) {
+        return {};
+    }
+
+    Update& update = slot->update;
+    update.id.assign(1, position);
+    update.mode = compiled->mode;
+    update.region = compiled->region;
+
+    const auto transform_start = this->trace.is_enabled()
+        ? TraceEvent::now()
+        : 0;
+
+    update.buffer.assign(compiled->buffer.cbegin(), compiled->buffer.cend());
+    update.compiled = std::move(compiled);
+
+    this->publish_slot(*slot, position, transform_start);
+    return position;
+}
+
+auto Display::to_display_region(const Region& region) -> std::optional<Region>
+{
+    // Transform from reMarkable coordinates to EPD coordinates:
+    // transpose to swap X and Y and flip X and Y
+    const Region trans_region{
+        /* top = */ epd_height - region.left - region.width,
+        /* left = */ epd_width - region.top - region.height,
+        /* width = */ region.height,
+        /* height = */ region.width
+    };
+
+    if (
+        trans_region.left >= epd_width
+        || trans_region.top >= epd_height
+        || trans_region.left + trans_region.width > epd_width
+        || trans_region.top + trans_region.height > epd_height
+    ) {
+        return {};
+    }
+
+    return trans_region;
+}
+
+void Display::convert_pixels(
+    ModeID mode,
+    const Region& region,
+    const Region& trans_region,
+    const void* data,
+    std::size_t stride,
+    PixelFormat format,
+    Intensity* dest
+) const
+{
+    const auto* bytes = static_cast<const std::uint8_t*>(data);
+
+    // Dithering thresholds follow display coordinates, so that the pattern
+    // stays aligned across updates
+    const bool dither = this->dithering.load(std::memory_order_relaxed);
+    const auto levels = get_mode_levels(this->table.get_mode_kind(mode));
+    const auto threshold = [&trans_region](std::size_t row, std::size_t col) {
+        return dither_matrix
+            [(trans_region.top + row) % dither_size]
+            [(trans_region.left + col) % dither_size];
+    };
+
+    switch (format) {
+    case PixelFormat::Intensity:
+#ifdef USE_NEON
+        transform_intensities_neon(bytes, stride, region, dest);
+#else
+        transform_region<1>(
+            bytes, stride, region, dest,
+            [](const std::uint8_t* pixel) {
+                return static_cast<Intensity>(
+                    *pixel & (intensity_values - 1)
+                );
+            }
+        );
+#endif // USE_NEON
+        break;
+
+    case PixelFormat::Y8:
+        if (dither) {
+            transform_region<1>(
+                bytes, stride, region, dest,
+                [&threshold, levels](
+                    const std::uint8_t* pixel,
+                    std::size_t row, std::size_t col
+                ) {
+                    return dither_y8(*pixel, levels, threshold(row, col));
+                }
+            );
+        } else {
+            transform_region<1>(
+                bytes, stride, region, dest,
+                [](const std::uint8_t* pixel) {
+                    return y8_to_intensity(*pixel);
+                }
+            );
+        }
+        break;
+
+    case PixelFormat::RGB565:
+        if (dither) {
+            const auto& grays = get_rgb565_grays();
+            transform_region<2>(
+                bytes, stride, region, dest,
+                [&grays, &threshold, levels](
+                    const std::uint8_t* pixel,
+                    std::size_t row, std::size_t col
+                ) {
+                    return dither_y8(
+                        grays[pixel[0] | (pixel[1] << 8)],
+                        levels, threshold(row, col)
+                    );
+                }
+            );
+        } else {
+            const auto& intensities = get_rgb565_intensities();
+            transform_region<2>(
+                bytes, stride, region, dest,
+                [&intensities](const std::uint8_t* pixel) {
+                    return intensities[pixel[0] | (pixel[1] << 8)];
+                }
+            );
+        }
+        break;
+    }
+
+}
+
+auto Display::claim_slot(UpdateID& position) -> UpdateSlot*
+{
+    position = this->update_ring_head.load(std::memory_order_relaxed);
+
+    for (;;) {
+        UpdateSlot* slot = &this->update_ring[position % update_ring_size];
+        auto sequence = slot->sequence.load(std::memory_order_acquire);
+        auto diff = static_cast<std::int64_t>(sequence - position);
+
+        if (diff == 0) {
+            if (this->update_ring_head.compare_exchange_weak(
+                position, position + 1,
+                std::memory_order_relaxed
+            )) {
+                return slot;
+            }
+        } else if (diff < 0) {
+            // The queue is full
+            return nullptr;
+        } else {
+            position = this->update_ring_head.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void Display::publish_slot(
+    UpdateSlot& slot,
+    UpdateID position,
+    std::uint64_t transform_start
+)
+{
+    if (transform_start != 0) {
+        const Update& update = slot.update;
+        TraceEvent event;
+        event.type = TraceEventType::Queue;
+        event.time = TraceEvent::now();
+        event.id = static_cast<std::uint32_t>(update.id.front());
+        event.mode = update.mode;
+        event.width = update.region.width;
+        event.height = update.region.height;
+        event.value = event.time - transform_start;
+        this->trace.record(event);
+    }
+
+    // Every claimed slot gets published, so that IDs taken from the slot
+    // positions are displayed without gaps
+    slot.sequence.store(position + 1, std::memory_order_release);
+
+#ifndef DRY_RUN
+    // Wake up the generator thread if it is waiting for updates. The fence
+    // pairs with the one in `wait_for_updates()` so that either the update
+    // is seen by the generator thread or its waiting flag is seen here
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (this->generator_waiting.exchange(false)) {
+        const std::uint64_t event = 1;
+        write(this->update_event_fd, &event, sizeof(event));
+    }
+#else
+    while (this->pop_updates()) {
+        this->generate_frame();
+    }
+#endif // DRY_RUN
+}
+
+auto Display::wait_for(UpdateID id) -> bool
+{
+    std::unique_lock<std::mutex> lock(this->completion_lock);
+    const auto is_displayed = [this, id] {
+        return id < this->displayed_below || this->displayed.count(id) > 0;
+    };
+
+    this->completion_cv.wait(lock, [this, &is_displayed] {
+        return is_displayed() || this->stopping_completion;
+    });
+
+    return is_displayed();
+}
+
+void Display::set_completion_callback(
+    std::function<void(UpdateID)> callback
+)
+{
+    this->completion_callback = std::move(callback);
+}
+
+void Display::complete_updates(const std::vector<UpdateID>& ids)
+{
+    if (this->trace.is_enabled()) {
+        TraceEvent event;
+        event.type = TraceEventType::Complete;
+        event.time = TraceEvent::now();
+
+        for (auto id : ids) {
+            event.id = static_cast<std::uint32_t>(id);
+            this->trace.record(event);
+        }
+    }
+
+    if (this->completion_callback) {
+        for (auto id : ids) {
+            this->completion_callback(id);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(this->completion_lock);
+        this->displayed.insert(ids.cbegin(), ids.cend());
+
+        while (
+            !this->displayed.empty()
+            && *this->displayed.begin() == this->displayed_below
+        ) {
+            this->displayed.erase(this->displayed.begin());
+            ++this->displayed_below;
+        }
+    }
+
+    this->completion_cv.notify_all();
+}
+
+void Display::skip_update(const Update& update)
+{
+#ifndef DRY_RUN
+    {
+        // Attach to the last generated frame if it is not sent yet
+        std::lock_guard<std::mutex> lock(this->frames_lock);
+
+        if (this->frames_generated > this->frames_vsynced) {
+            auto& finished = this->frame_info[
+                (this->frames_generated - 1) % buf_usable_frames
+            ].finished;
+
+            finished.insert(
+                finished.end(),
+                update.id.cbegin(), update.id.cend()
+            );
+            return;
+        }
+    }
+#endif // DRY_RUN
+
+    this->complete_updates(update.id);
+}
+
+void Display::run_generator_thread()
+{
+    while (this->pop_updates()) {
+        this->generate_frame();
+    }
+}
+
+auto Display::has_incoming_update() const -> bool
+{
+    const auto& slot = this->update_ring[
+        this->update_ring_tail % update_ring_size
+    ];
+
+    return slot.sequence.load(std::memory_order_acquire)
+        == this->update_ring_tail + 1;
+}
+
+auto Display::wait_for_updates() -> bool
+{
+    while (!this->stopping_generator && !this->has_incoming_update()) {
+        this->generator_waiting = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (this->has_incoming_update() || this->stopping_generator) {
+            this->generator_waiting = false;
+            break;
+        }
+
+        std::uint64_t events;
+
+        if (
+            read(this->update_event_fd, &events, sizeof(events)) == -1
+            && errno != EINTR
+        ) {
+            // Don’t throw here, since we’re inside a background thread
+            std::cerr << "Wait for updates: " << std::strerror(errno) << '\n';
+            return false;
+        }
+    }
+
+    return !this->stopping_generator;
+}
+
+void Display::drain_updates()
+{
+    while (this->has_incoming_update()) {
+        auto& slot = this->update_ring[
+            this->update_ring_tail % update_ring_size
+        ];
+
+        // Leave a recycled update in the slot so that its memory gets
+        // reused by the next incoming update
+        Update update;
+
+        if (!this->free_updates.empty()) {
+            update = std::move(this->free_updates.back());
+            this->free_updates.pop_back();
+        }
+
+        std::swap(update, slot.update);
+        slot.sequence.store(
+            this->update_ring_tail + update_ring_size,
+            std::memory_order_release
+        );
+
+        ++this->update_ring_tail;
+        this->pending_updates.push_back(std::move(update));
+    }
+}
+
+void Display::recycle_update(Update update)
+{
+    update.compiled.reset();
+
+    if (
+        update.buffer.capacity() <= max_pooled_buffer
+        && this->free_updates.size() < update_ring_size
+    ) {
+        this->free_updates.push_back(std::move(update));
+    }
+}
+
+bool Display::pop_updates()
+{
+    for (;;) {
+#ifndef DRY_RUN
+        if (
+            this->active_updates.empty()
+            && this->pending_updates.empty()
+            && !this->wait_for_updates()
+        ) {
+            return false;
+        }
+
+        if (this->stopping_generator) {
+            return false;
+        }
+#endif // DRY_RUN
+
+        this->drain_updates();
+
+#ifdef DRY_RUN
+        if (this->pending_updates.empty() && this->active_updates.empty()) {
+            return false;
+        }
+#endif // DRY_RUN
+
+        std::vector<Update> started;
+
+        // Regions that starting updates must not overlap: regions of
+        // pending updates that have to wait, so that updates touching the
+        // same cells are applied in the order they were queued
+        std::vector<Region> waiting;
+
+        // Check whether a region overlaps a waiting update or cells of an
+        // active update that are still transitioning
+        const auto is_blocked = [this, &waiting](const Region& region) {
+            for (const auto& other : waiting) {
+                if (intersects(region, other)) {
+                    return true;
+                }
+            }
+
+            for (auto& active : this->active_updates) {
+                const auto& other = active.update.region;
+
+                if (
+                    intersects(region, other)
+                    && !this->is_released(active, intersection(region, other))
+                ) {
+                    return true;
+                }
+            }
+
+            return false;
+        };
+
+        // Aligned regions of the updates started so far
+        std::vector<Region> started_regions;
+        const float waste_threshold = this->merge_waste_threshold;
+        auto it = this->pending_updates.begin();
+
+        while (it != this->pending_updates.end()) {
+            const Region region = align_region(it->region);
+
+            if (is_blocked(region)) {
+                waiting.push_back(region);
+                ++it;
+                continue;
+            }
+
+            const bool is_full = (
+                this->active_updates.size() + started.size()
+                >= max_active_updates
+            );
+
+            // Try merging into one of the updates started so far
+            bool merged = false;
+
+            for (std::size_t i = 0; i < started.size() && !merged; ++i) {
+                const Region& started_region = started_regions[i];
+                const bool overlap = intersects(started_region, region);
+                const bool promote = started[i].mode != it->mode;
+                auto mode = this->merge_mode(started[i].mode, it->mode);
+
+                // Merge updates that touch the same cells instead of
+                // serializing them, unless that promotes one of them to
+                // a mode driving too much unrelated area. Otherwise merge
+                // only if it saves an update without wasting too much area,
+                // and if promoting a mode costs less than running both
+                if (
+                    !mode
+                    || (
+                        (promote || (!overlap && !is_full))
+                        && merge_waste(started_region, region)
+                            > waste_threshold
+                    )
+                    || (
+                        !overlap && promote
+                        && !this->is_merge_cheaper(
+                            started[i].mode, started_region,
+                            it->mode, region,
+                            *mode
+                        )
+                    )
+                ) {
+                    continue;
+                }
+
+                const Region merged_region = bounding_box(
+                    started_region, region
+                );
+
+                bool can_merge = !is_blocked(merged_region);
+
+                for (std::size_t j = 0; j < started.size(); ++j) {
+                    if (
+                        j != i
+                        && intersects(merged_region, started_regions[j])
+                    ) {
+                        can_merge = false;
+                    }
+                }
+
+                if (can_merge) {
+                    this->merge_update(started[i], *it);
+                    started[i].mode = *mode;
+                    started_regions[i] = merged_region;
+                    merged = true;
+                }
+            }
+
+            if (merged) {
+                this->recycle_update(std::move(*it));
+                it = this->pending_updates.erase(it);
+                continue;
+            }
+
+            const bool can_start = !is_full && std::none_of(
+                started_regions.cbegin(), started_regions.cend(),
+                [&region](const Region& other) {
+                    return intersects(region, other);
+                }
+            );
+
+            if (can_start) {
+                started_regions.push_back(region);
+                started.push_back(std::move(*it));
+                it = this->pending_updates.erase(it);
+            } else {
+                waiting.push_back(region);
+                ++it;
+            }
+        }
+
+        for (auto& update : started) {
+            if (this->trace.is_enabled()) {
+                TraceEvent event;
+                event.type = TraceEventType::Dequeue;
+                event.time = TraceEvent::now();
+                event.id = static_cast<std::uint32_t>(update.id.front());
+                this->trace.record(event);
+            }
+
+            // Take over the cells of active updates that finished
+            // transitioning
+            const Region region = align_region(update.region);
+
+            for (auto& active : this->active_updates) {
+                const auto& other = active.update.region;
+
+                if (intersects(region, other)) {
+                    this->release_region(active, intersection(region, other));
+                }
+            }
+
+            this->activate_update(std::move(update));
+        }
+
+        if (!this->active_updates.empty()) {
+            return true;
+        }
+    }
+}
+
+void Display::merge_update(Update& cur_update, const Update& next_update)
+{
+    // Recorded frames do not apply to the merged contents
+    cur_update.compiled.reset();
+
+    std::copy(
+        next_update.id.cbegin(), next_update.id.cend(),
+        std::back_inserter(cur_update.id)
+    );
+
+    if (this->trace.is_enabled()) {
+        TraceEvent event;
+        event.type = TraceEventType::Merge;
+        event.time = TraceEvent::now();
+        event.id = static_cast<std::uint32_t>(next_update.id.front());
+        event.value = static_cast<std::uint32_t>(cur_update.id.front());
+        this->trace.record(event);
+    }
+
+    Region merged_region = bounding_box(cur_update.region, next_update.region);
+    const auto width = merged_region.width;
+    const auto height = merged_region.height;
+
+    std::vector<Intensity> merged_buffer(width * height);
+
+    merge_rects(
+        this->current_intensity.data(), epd_width, merged_region,
+        cur_update.region, cur_update.buffer.data(),
+        next_update.region, next_update.buffer.data(),
+        merged_buffer.data()
+    );
+
+    cur_update.region = std::move(merged_region);
+    cur_update.buffer = std::move(merged_buffer);
+}
+
+auto Display::align_region(Region region) -> Region
+{
+    constexpr auto mask = buf_actual_depth - 1;
+    auto right = (region.left + region.width + mask) & ~mask;
+    region.left &= ~mask;
+    region.width = right - region.left;
+    return region;
+}
+
+auto Display::merge_mode(ModeID first, ModeID second) const
+-> std::optional<ModeID>
+{
+    if (first == second) {
+        return first;
+    }
+
+    // Modes that can stand in for lower-fidelity ones, in increasing order
+    // of fidelity. Init and unknown modes are never merged with others
+    constexpr auto fidelity = [](ModeKind kind) -> int {
+        switch (kind) {
+        case ModeKind::A2: return 1;
+        case ModeKind::DU: return 2;
+        case ModeKind::DU4: return 3;
+        case ModeKind::GC16: return 4;
+        case ModeKind::GLR16: return 4;
+        default: return 0;
+        }
+    };
+
+    int first_fidelity = fidelity(this->table.get_mode_kind(first));
+    int second_fidelity = fidelity(this->table.get_mode_kind(second));
+
+    if (first_fidelity == 0 || second_fidelity == 0) {
+        return {};
+    }
+
+    if (first_fidelity > second_fidelity) {
+        return first;
+    }
+
+    if (second_fidelity > first_fidelity) {
+        return second;
+    }
+
+    return {};
+}
+
+auto Display::merge_waste(const Region& first, const Region& second) -> float
+{
+    const auto area = [](const Region& region) {
+        return static_cast<std::uint64_t>(region.width) * region.height;
+    };
+
+    const std::uint64_t merged_area = area(bounding_box(first, second));
+
+    if (merged_area == 0) {
+        return 0;
+    }
+
+    const std::uint64_t used_area = area(first) + area(second);
+    return merged_area > used_area
+        ? static_cast<float>(merged_area - used_area) / merged_area
+        : 0;
+}
+
+auto Display::is_merge_cheaper(
+    ModeID first_mode,
+    const Region& first,
+    ModeID second_mode,
+    const Region& second,
+    ModeID merged_mode
+) -> bool
+{
+    const auto cost = [this](ModeID mode, const Region& region) {
+        return static_cast<std::uint64_t>(region.width) * region.height
+            * this->get_waveform(mode)->size();
+    };
+
+    return cost(merged_mode, bounding_box(first, second))
+        <= cost(first_mode, first) + cost(second_mode, second);
+}
+
+void Display::set_merge_waste_threshold(float threshold)
+{
+    this->merge_waste_threshold = threshold;
+}
+
+auto Display::get_merge_waste_threshold() const -> float
+{
+    return this->merge_waste_threshold;
+}
+
+void Display::set_dithering(bool enabled)
+{
+    this->dithering = enabled;
+}
+
+auto Display::get_dithering() const -> bool
+{
+    return this->dithering;
+}
+
+void Display::set_power_off_timeout(chrono::milliseconds timeout)
+{
+    this->power_off_timeout = timeout;
+}
+
+auto Display::get_power_off_timeout() const -> chrono::milliseconds
+{
+    return this->power_off_timeout;
+}
+
+void Display::hint_activity()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->frames_lock);
+        this->power_hint = true;
+    }
+
+    this->frames_ready_cv.notify_one();
+}
+
+void Display::set_tracing(bool enabled)
+{
+    this->trace.set_enabled(enabled);
+}
+
+auto Display::get_tracing() const -> bool
+{
+    return this->trace.is_enabled();
+}
+
+auto Display::pull_trace() -> std::vector<TraceEvent>
+{
+    return this->trace.pull();
+}
+
+auto Display::get_perf_report(bool include_header) -> std::string
+{
+    std::lock_guard<std::mutex> lock(this->perf_report_lock);
+    std::string result = include_header ? PerfReport::get_header() : "";
+    result += this->perf_report.add(this->trace.pull());
+    return result;
+}
+
+auto Display::get_idle_timeout() const -> chrono::steady_clock::duration
+{
+    const chrono::steady_clock::duration timeout
+        = this->power_off_timeout.load();
+    const auto count = std::min(this->idle_history_count, idle_history_size);
+
+    // Wait for the full timeout until enough gaps are known
+    if (count < idle_history_size / 4) {
+        return timeout;
+    }
+
+    // Gaps short enough for the controller to stay on during them
+    std::vector<chrono::steady_clock::duration> covered;
+
+    for (std::size_t i = 0; i < count; ++i) {
+        if (this->idle_history[i] <= timeout) {
+            covered.push_back(this->idle_history[i]);
+        }
+    }
+
+    // Staying on is wasted if most updates come after the timeout anyway
+    if (covered.size() < count / 4) {
+        return min_power_off_timeout;
+    }
+
+    // Cover most of the short gaps, with some margin
+    std::sort(covered.begin(), covered.end());
+    const auto gap = covered[(covered.size() - 1) * 9 / 10];
+
+    return std::clamp(
+        gap * 5 / 4,
+        chrono::steady_clock::duration{min_power_off_timeout},
+        timeout
+    );
+}
+
+void Display::align_update(Update& update)
+{
+    align_rect(
+        this->current_intensity.data(), epd_width,
+        update.region, update.buffer
+    );
+}
+
+auto Display::shrink_update(Update& update) -> bool
+{
+    const auto& region = update.region;
+
+    if (region.width == 0 || region.height == 0) {
+        return false;
+    }
+
+    // Bounding box of the changed cells
+    auto top = epd_height;
+    auto left = epd_width;
+    std::uint32_t bottom = 0;
+    std::uint32_t right = 0;
+
+    const Intensity* next = update.buffer.data();
+    const Intensity* prev = this->current_intensity.data()
+        + region.top * epd_width
+        + region.left;
+
+    for (std::uint32_t y = 0; y < region.height; ++y) {
+        const auto first = std::mismatch(
+            next, next + region.width, prev
+        ).first;
+
+        if (first != next + region.width) {
+            const auto last = std::mismatch(
+                std::make_reverse_iterator(next + region.width),
+                std::make_reverse_iterator(first),
+                std::make_reverse_iterator(prev + region.width)
+            ).first.base();
+
+            top = std::min(top, region.top + y);
+            bottom = region.top + y + 1;
+            left = std::min(
+                left,
+                region.left + static_cast<std::uint32_t>(first - next)
+            );
+            right = std::max(
+                right,
+                region.left + static_cast<std::uint32_t>(last - next)
+            );
+        }
+
+        next += region.width;
+        prev += epd_width;
+    }
+
+    if (bottom == 0) {
+        return false;
+    }
+
+    const Region shrunk{top, left, right - left, bottom - top};
+
+    if (shrunk.width == region.width && shrunk.height == region.height) {
+        return true;
+    }
+
+    std::vector<Intensity> new_buffer(shrunk.width * shrunk.height);
+
+    copy_rect(
+        /* source = */ update.buffer.data(),
+        /* source_region = */ Region{
+            shrunk.top - region.top,
+            shrunk.left - region.left,
+            shrunk.width,
+            shrunk.height
+        },
+        /* source_width = */ region.width,
+        /* dest = */ new_buffer.data(),
+        /* dest_top = */ 0,
+        /* dest_left = */ 0,
+        /* dest_width = */ shrunk.width
+    );
+
+    update.buffer = std::move(new_buffer);
+    update.region = shrunk;
+    return true;
+}
+
+namespace
+{
+
+/** Check whether a phase matrix drives any transition of a mask. */
+inline bool has_effect(const PhaseMatrix& matrix, const TransitionMask& mask)
+{
+    std::uint32_t result = 0;
+
+    for (std::size_t i = 0; i < mask.size(); ++i) {
+        result |= matrix.words[i] & mask[i];
+    }
+
+    return result != 0;
+}
+
+/**
+ * Find, for each transition, the lowest source intensity that receives
+ * the same phases as its actual source in all frames of a waveform.
+ *
+ * @return Equivalent source intensities, indexed by `(from << 5) | to`.
+ */
+auto find_equivalent_sources(const Waveform& waveform)
+-> std::array<Intensity, intensity_values * intensity_values>
+{
+    std::array<Intensity, intensity_values * intensity_values> result;
+
+    for (Intensity to = 0; to < intensity_values; ++to) {
+        for (Intensity from = 0; from < intensity_values; ++from) {
+            Intensity equivalent = 0;
+
+            while (equivalent < from && !std::all_of(
+                waveform.begin(), waveform.end(),
+                [equivalent, from, to](const PhaseMatrix& matrix) {
+                    return matrix.get(equivalent, to)
+                        == matrix.get(from, to);
+                }
+            )) {
+                ++equivalent;
+            }
+
+            result[(from << 5) | to] = equivalent;
+        }
+    }
+
+    return result;
+}
+
+/** Check whether a waveform drives cells that keep the same intensity. */
+bool drives_unchanged(const Waveform& waveform)
+{
+    TransitionMask mask{};
+
+    for (std::size_t i = 0; i < intensity_values; ++i) {
+        mask[i * 2 + (i >> 4)] |= std::uint32_t{3} << ((i & 15) * 2);
+    }
+
+    return std::any_of(
+        waveform.begin(), waveform.end(),
+        [&mask](const PhaseMatrix& matrix) {
+            return has_effect(matrix, mask);
+        }
+    );
+}
+
+} // anonymous namespace
+
+void Display::check_consecutive(ActiveUpdate& active)
+{
+    static_assert(buf_actual_depth == cell_group);
+    const auto& update = active.update;
+    const auto& region = update.region;
+
+    find_consecutive(
+        this->current_intensity.data()
+            + region.top * epd_width
+            + region.left,
+        epd_width,
+        update.buffer.data(),
+        region.width,
+        region.height,
+        active.is_consecutive,
+        active.transition_mask
+    );
+}
+
+auto Display::scan_transitions(ActiveUpdate& active) -> std::size_t
+{
+    const auto& update = active.update;
+    const auto& region = update.region;
+    auto& transition_ids = active.transition_ids;
+    auto& transitions = active.transitions;
+
+    transition_ids.fill(no_transition);
+    transitions.clear();
+
+    const Intensity* prev = this->current_intensity.data()
+        + region.top * epd_width
+        + region.left;
+    const Intensity* next = update.buffer.data();
+
+    for (std::size_t y = 0; y < region.height; ++y) {
+        for (std::size_t x = 0; x < region.width; ++x) {
+            std::uint16_t transition = (*prev++ << 5) | *next++;
+
+            if (transition_ids[transition] == no_transition) {
+                if (transitions.size() == max_lut_transitions) {
+                    return 0;
+                }
+
+                transition_ids[transition] = transitions.size();
+                transitions.push_back(transition);
+            }
+        }
+
+        prev += epd_width - region.width;
+    }
+
+    // Pack as many 8-bit, 4-bit or 2-bit IDs as possible in each key
+    if (transitions.size() <= 4) {
+        return 4;
+    }
+
+#ifndef USE_NEON
+    // The NEON kernel handles one ID per key faster than this
+    if (transitions.size() <= 16) {
+        return 2;
+    }
+#endif // USE_NEON
+
+    return 1;
+}
+
+namespace
+{
+
+// Order in which cells from a group of `buf_actual_depth` cells are laid out
+// in the two phase bytes of a frame pixel
+constexpr std::size_t byte_order[] = {4, 5, 6, 7, 0, 1, 2, 3};
+
+#ifdef USE_NEON
+/**
+ * Look up the phases for 8 transition IDs.
+ *
+ * @param tables Phase table, split in blocks of 32 IDs.
+ * @param table_count Number of blocks in use.
+ * @param ids Transition IDs.
+ * @return Phase for each ID.
+ */
+inline uint8x8_t lookup_phases(
+    const uint8x8x4_t* tables,
+    std::size_t table_count,
+    uint8x8_t ids
+)
+{
+    // Out-of-range indices leave the destination lane untouched
+    // when using VTBX, so chained lookups cover the whole table
+    const uint8x8_t block_size = vdup_n_u8(32);
+    uint8x8_t result = vtbl4_u8(tables[0], ids);
+
+    for (std::size_t t = 1; t < table_count; ++t) {
+        ids = vsub_u8(ids, block_size);
+        result = vtbx4_u8(result, tables[t], ids);
+    }
+
+    return result;
+}
+
+/**
+ * Pack the phases of groups of 8 cells into two bytes each.
+ *
+ * @param tables Phase table, split in blocks of 32 IDs.
+ * @param table_count Number of blocks in use.
+ * @param keys Transition IDs of each cell, in frame byte order.
+ * @param groups Number of groups in each row.
+ * @param rows Number of rows.
+ * @param data Pointer to the first frame byte to write.
+ * @param depth Number of bytes per frame pixel.
+ * @param stride Number of bytes per frame row.
+ */
+void write_packed_phases_neon(
+    const uint8x8x4_t* tables,
+    std::size_t table_count,
+    const std::uint8_t* keys,
+    std::size_t groups,
+    std::size_t rows,
+    std::uint8_t* data,
+    std::size_t depth,
+    std::size_t stride
+)
+{
+    // Shift each phase to its position in the packed byte, so that adding
+    // pairs of lanes twice in a row produces the packed bytes
+    constexpr std::int8_t shift_values[] = {6, 4, 2, 0, 6, 4, 2, 0};
+    const int8x8_t shifts = vld1_s8(shift_values);
+
+    const auto phases = [&](const std::uint8_t* ids) {
+        return vshl_u8(
+            lookup_phases(tables, table_count, vld1_u8(ids)),
+            shifts
+        );
+    };
+
+    for (std::size_t y = 0; y < rows; ++y) {
+        std::size_t x = 0;
+
+        // Process 32 cells at a time
+        for (; x + 4 <= groups; x += 4) {
+            uint16x4_t packed = vreinterpret_u16_u8(vpadd_u8(
+                vpadd_u8(phases(keys), phases(keys + 8)),
+                vpadd_u8(phases(keys + 16), phases(keys + 24))
+            ));
+
+            vst1_lane_u16(reinterpret_cast<std::uint16_t*>(data), packed, 0);
+            vst1_lane_u16(
+                reinterpret_cast<std::uint16_t*>(data + depth), packed, 1
+            );
+            vst1_lane_u16(
+                reinterpret_cast<std::uint16_t*>(data + 2 * depth), packed, 2
+            );
+            vst1_lane_u16(
+                reinterpret_cast<std::uint16_t*>(data + 3 * depth), packed, 3
+            );
+
+            keys += 32;
+            data += 4 * depth;
+        }
+
+        for (; x < groups; ++x) {
+            uint8x8_t group = phases(keys);
+            uint16x4_t packed = vreinterpret_u16_u8(
+                vpadd_u8(vpadd_u8(group, group), group)
+            );
+
+            vst1_lane_u16(reinterpret_cast<std::uint16_t*>(data), packed, 0);
+
+            keys += 8;
+            data += depth;
+        }
+
+        data += stride - groups * depth;
+    }
+}
+#endif // USE_NEON
+
+} // anonymous namespace
+
+void Display::pack_transitions(ActiveUpdate& active)
+{
+    const auto& update = active.update;
+    const auto& region = update.region;
+    const std::size_t pixels_per_key = active.pixels_per_key;
+    const std::size_t id_bits = 8 / pixels_per_key;
+
+    active.transition_keys.resize(
+        region.width * region.height / pixels_per_key
+    );
+
+    const Intensity* prev = this->current_intensity.data()
+        + region.top * epd_width
+        + region.left;
+    const Intensity* next = update.buffer.data();
+    std::uint8_t* keys = active.transition_keys.data();
+
+    for (std::size_t y = 0; y < region.height; ++y) {
+        for (std::size_t x = 0; x < region.width / buf_actual_depth; ++x) {
+            for (std::size_t p = 0; p < buf_actual_depth;) {
+                std::uint8_t key = 0;
+
+                for (std::size_t q = 0; q < pixels_per_key; ++q, ++p) {
+                    auto i = byte_order[p];
+                    key = (key << id_bits)
+                        | active.transition_ids[(prev[i] << 5) | next[i]];
+                }
+
+                *keys++ = key;
+            }
+
+            prev += buf_actual_depth;
+            next += buf_actual_depth;
+        }
+
+        prev += epd_width - region.width;
+    }
+}
+
+void Display::write_frame_lut(
+    const ActiveUpdate& active,
+    const PhaseMatrix& matrix,
+    std::uint8_t* data,
+    std::size_t row_begin,
+    std::size_t row_end
+)
+{
+    const auto& region = active.update.region;
+    const auto& transitions = active.transitions;
+    const std::size_t pixels_per_key = active.pixels_per_key;
+
+    // Phase to apply for each transition ID
+    std::array<std::uint8_t, max_lut_transitions> phases{};
+
+    for (std::size_t id = 0; id < transitions.size(); ++id) {
+        auto transition = transitions[id];
+        phases[id] = static_cast<std::uint8_t>(
+            matrix.get(transition >> 5, transition & (intensity_values - 1))
+        );
+    }
+
+#ifdef USE_NEON
+    if (pixels_per_key == 1) {
+        std::array<uint8x8x4_t, max_lut_transitions / 32> tables;
+        const std::size_t table_count = (transitions.size() + 31) / 32;
+
+        for (std::size_t t = 0; t < table_count; ++t) {
+            for (std::size_t j = 0; j < 4; ++j) {
+                tables[t].val[j] = vld1_u8(phases.data() + t * 32 + j * 8);
+            }
+        }
+
+        write_packed_phases_neon(
+            tables.data(), table_count,
+            active.transition_keys.data() + row_begin * region.width,
+            region.width / buf_actual_depth, row_end - row_begin,
+            data + row_begin * buf_stride, buf_depth, buf_stride
+        );
+        return;
+    }
+#endif // USE_NEON
+
+    // Packed phases to apply for each key
+    std::array<std::uint8_t, 256> lut;
+    const std::size_t id_bits = 8 / pixels_per_key;
+    const std::size_t id_mask = (1 << id_bits) - 1;
+
+    for (std::size_t key = 0; key < lut.size(); ++key) {
+        std::uint8_t packed = 0;
+
+        for (std::size_t q = pixels_per_key; q > 0; --q) {
+            packed = (packed << 2) | phases[(key >> (id_bits * (q - 1))) & id_mask];
+        }
+
+        lut[key] = packed;
+    }
+
+    const std::uint8_t* keys = active.transition_keys.data()
+        + row_begin * region.width / pixels_per_key;
+    const std::size_t groups = region.width / buf_actual_depth;
+    data += row_begin * buf_stride;
+
+    for (std::size_t y = row_begin; y < row_end; ++y) {
+        switch (pixels_per_key) {
+        case 4:
+            for (std::size_t x = 0; x < groups; ++x) {
+                data[0] = lut[keys[0]];
+                data[1] = lut[keys[1]];
+                keys += 2;
+                data += buf_depth;
+            }
+            break;
+
+        case 2:
+            for (std::size_t x = 0; x < groups; ++x) {
+                data[0] = (lut[keys[0]] << 4) | lut[keys[1]];
+                data[1] = (lut[keys[2]] << 4) | lut[keys[3]];
+                keys += 4;
+                data += buf_depth;
+            }
+            break;
+
+        default:
+            for (std::size_t x = 0; x < groups; ++x) {
+                data[0] = (lut[keys[0]] << 6) | (lut[keys[1]] << 4)
+                    | (lut[keys[2]] << 2) | lut[keys[3]];
+                data[1] = (lut[keys[4]] << 6) | (lut[keys[5]] << 4)
+                    | (lut[keys[6]] << 2) | lut[keys[7]];
+                keys += 8;
+                data += buf_depth;
+            }
+            break;
+        }
+
+        data += buf_stride - groups * buf_depth;
+    }
+}
+
+void Display::write_frame_direct(
+    const ActiveUpdate& active,
+    const PhaseMatrix& matrix,
+    std::uint8_t* data,
+    std::size_t row_begin,
+    std::size_t row_end
+)
+{
+    const auto& update = active.update;
+    const auto& region = update.region;
+    const auto& is_consecutive = active.is_consecutive;
+    const std::size_t groups = region.width / buf_actual_depth;
+    const Intensity* prev = this->current_intensity.data()
+        + (region.top + row_begin) * epd_width
+        + region.left;
+    const Intensity* next = update.buffer.data() + row_begin * region.width;
+    data += row_begin * buf_stride;
+
+    // The first group of a band cannot reuse the phases of its predecessor
+    const std::size_t first = row_begin * groups;
+    std::size_t i = first;
+    std::uint8_t byte1 = 0;
+    std::uint8_t byte2 = 0;
+
+    for (std::size_t y = row_begin; y < row_end; ++y) {
+        for (std::size_t x = 0; x < groups; ++x) {
+            if (i == first || !is_consecutive[i]) {
+                auto phase1 = matrix.get(*prev++, *next++);
+                auto phase2 = matrix.get(*prev++, *next++);
+                auto phase3 = matrix.get(*prev++, *next++);
+                auto phase4 = matrix.get(*prev++, *next++);
+                auto phase5 = matrix.get(*prev++, *next++);
+                auto phase6 = matrix.get(*prev++, *next++);
+                auto phase7 = matrix.get(*prev++, *next++);
+                auto phase8 = matrix.get(*prev++, *next++);
+
+                byte1 = (
+                    (static_cast<std::uint8_t>(phase5) << 6)
+                    | (static_cast<std::uint8_t>(phase6) << 4)
+                    | (static_cast<std::uint8_t>(phase7) << 2)
+                    | static_cast<std::uint8_t>(phase8)
+                );
+
+                byte2 = (
+                    (static_cast<std::uint8_t>(phase1) << 6)
+                    | (static_cast<std::uint8_t>(phase2) << 4)
+                    | (static_cast<std::uint8_t>(phase3) << 2)
+                    | static_cast<std::uint8_t>(phase4)
+                );
+            } else {
+                prev += buf_actual_depth;
+                next += buf_actual_depth;
+            }
+
+            *data++ = byte1;
+            *data++ = byte2;
+            data += 2;
+            ++i;
+        }
+
+        prev += epd_width - region.width;
+        data += buf_stride - groups * buf_depth;
+    }
+}
+
+namespace
+{
+
+// Intensities of the cells of a binary update
+constexpr Intensity binary_black = 0;
+constexpr Intensity binary_white = 30;
+
+} // anonymous namespace
+
+auto Display::scan_binary(ActiveUpdate& active) -> bool
+{
+    const auto& update = active.update;
+    const auto& region = update.region;
+    const std::size_t groups = region.width / buf_actual_depth;
+    auto& planes = active.binary_planes;
+    planes.resize(groups * region.height);
+
+    const Intensity* prev = this->current_intensity.data()
+        + region.top * epd_width
+        + region.left;
+    const Intensity* next = update.buffer.data();
+    std::uint32_t* plane = planes.data();
+
+    // Union of the cells going through each of the four possible
+    // transitions, to find out which ones are present
+    std::uint32_t black_black = 0;
+    std::uint32_t black_white = 0;
+    std::uint32_t white_black = 0;
+    std::uint32_t white_white = 0;
+
+    for (std::size_t y = 0; y < region.height; ++y) {
+        for (std::size_t x = 0; x < groups; ++x) {
+            std::uint32_t prev_white = 0;
+            std::uint32_t next_white = 0;
+
+            for (std::size_t k = 0; k < buf_actual_depth; ++k) {
+                // Cell k is stored in bits 15 - 2k and 14 - 2k, which puts
+                // cells 4-7 in the first frame byte and 0-3 in the second
+                const auto shift = 14 - 2 * k;
+
+                if (prev[k] == binary_white) {
+                    prev_white |= std::uint32_t{3} << shift;
+                } else if (prev[k] != binary_black) {
+                    return false;
+                }
+
+                if (next[k] == binary_white) {
+                    next_white |= std::uint32_t{3} << shift;
+                } else if (next[k] != binary_black) {
+                    return false;
+                }
+            }
+
+            black_black |= ~prev_white & ~next_white;
+            black_white |= ~prev_white & next_white;
+            white_black |= prev_white & ~next_white;
+            white_white |= prev_white & next_white;
+            *plane++ = prev_white | (next_white << 16);
+
+            prev += buf_actual_depth;
+            next += buf_actual_depth;
+        }
+
+        prev += epd_width - region.width;
+    }
+
+    auto& mask = active.transition_mask;
+    mask.fill(0);
+
+    const auto mark = [&mask](
+        std::uint32_t cells,
+        Intensity from,
+        Intensity to
+    ) {
+        if ((cells & 0xFFFF) != 0) {
+            mask[from * 2 + (to >> 4)] |= std::uint32_t{3} << ((to & 15) * 2);
+        }
+    };
+
+    mark(black_black, binary_black, binary_black);
+    mark(black_white, binary_black, binary_white);
+    mark(white_black, binary_white, binary_black);
+    mark(white_white, binary_white, binary_white);
+    return true;
+}
+
+void Display::write_frame_binary(
+    const ActiveUpdate& active,
+    const PhaseMatrix& matrix,
+    std::uint8_t* data,
+    std::size_t row_begin,
+    std::size_t row_end
+)
+{
+    const auto& region = active.update.region;
+    const std::size_t groups = region.width / buf_actual_depth;
+    const std::uint32_t* plane = active.binary_planes.data()
+        + row_begin * groups;
+    data += row_begin * buf_stride;
+
+    // Phase of each transition, repeated for all cells of a group
+    const auto spread = [&matrix](Intensity from, Intensity to) {
+        return static_cast<std::uint16_t>(
+            static_cast<std::uint16_t>(matrix.get(from, to)) * 0x5555
+        );
+    };
+
+    const std::uint16_t black_black = spread(binary_black, binary_black);
+    const std::uint16_t black_white = spread(binary_black, binary_white);
+    const std::uint16_t white_black = spread(binary_white, binary_black);
+    const std::uint16_t white_white = spread(binary_white, binary_white);
+
+#ifdef USE_NEON
+    const uint16x8_t bb = vdupq_n_u16(black_black);
+    const uint16x8_t bw = vdupq_n_u16(black_white);
+    const uint16x8_t wb = vdupq_n_u16(white_black);
+    const uint16x8_t ww = vdupq_n_u16(white_white);
+#endif // USE_NEON
+
+    for (std::size_t y = row_begin; y < row_end; ++y) {
+        std::size_t x = 0;
+
+#ifdef USE_NEON
+        // Process 64 cells at a time, de-interleaving the planes on load
+        for (; x + 8 <= groups; x += 8) {
+            uint16x8x2_t planes = vld2q_u16(
+                reinterpret_cast<const std::uint16_t*>(plane)
+            );
+            uint16x8_t from_white = vbslq_u16(planes.val[1], ww, wb);
+            uint16x8_t from_black = vbslq_u16(planes.val[1], bw, bb);
+            uint16x8_t phases = vbslq_u16(
+                planes.val[0], from_white, from_black
+            );
+
+            auto* out = reinterpret_cast<std::uint16_t*>(data);
+            vst1q_lane_u16(out, phases, 0);
+            vst1q_lane_u16(out + buf_depth / 2, phases, 1);
+            vst1q_lane_u16(out + buf_depth, phases, 2);
+            vst1q_lane_u16(out + 3 * buf_depth / 2, phases, 3);
+            vst1q_lane_u16(out + 2 * buf_depth, phases, 4);
+            vst1q_lane_u16(out + 5 * buf_depth / 2, phases, 5);
+            vst1q_lane_u16(out + 3 * buf_depth, phases, 6);
+            vst1q_lane_u16(out + 7 * buf_depth / 2, phases, 7);
+
+            plane += 8;
+            data += 8 * buf_depth;
+        }
+#endif // USE_NEON
+
+        for (; x < groups; ++x) {
+            const std::uint32_t prev_white = *plane;
+            const std::uint32_t next_white = *plane >> 16;
+            const std::uint32_t from_white = (next_white & white_white)
+                | (~next_white & white_black);
+            const std::uint32_t from_black = (next_white & black_white)
+                | (~next_white & black_black);
+            const std::uint32_t phases = (prev_white & from_white)
+                | (~prev_white & from_black);
+
+            data[0] = phases;
+            data[1] = phases >> 8;
+
+            ++plane;
+            data += buf_depth;
+        }
+
+        data += buf_stride - groups * buf_depth;
+    }
+}
+
+auto Display::trim_frames(ActiveUpdate& active) -> bool
+{
+    const auto& waveform = *active.waveform;
+    const auto& mask = active.transition_mask;
+    std::size_t begin = 0;
+    std::size_t end = waveform.size();
+
+    while (begin < end && !has_effect(waveform[begin], mask)) {
+        ++begin;
+    }
+
+    while (end > begin && !has_effect(waveform[end - 1], mask)) {
+        --end;
+    }
+
+    active.frame = begin;
+    active.frame_end = end;
+    return begin < end;
+}
+
+void Display::activate_update(Update update)
+{
+    ActiveUpdate active;
+    active.update = std::move(update);
+    active.waveform = this->get_waveform(active.update.mode);
+
+    const auto activate_time = this->trace.is_enabled()
+        ? TraceEvent::now()
+        : 0;
+
+    const auto push_active = [this, activate_time](ActiveUpdate active) {
+        if (this->trace.is_enabled()) {
+            TraceEvent event;
+            event.type = TraceEventType::Activate;
+            event.time = activate_time;
+            event.frame = this->frames_generated;
+            event.id = static_cast<std::uint32_t>(active.update.id.front());
+            event.mode = active.update.mode;
+            event.width = active.update.region.width;
+            event.height = active.update.region.height;
+            event.value = active.frame_end - active.frame;
+            this->trace.record(event);
+        }
+
+        this->active_updates.push_back(std::move(active));
+    };
+
+    const bool compiled = active.update.compiled != nullptr;
+
+    if (compiled) {
+        this->align_update(active.update);
+
+        if (this->start_replay(active)) {
+            push_active(std::move(active));
+            return;
+        }
+    }
+
+    // Cells that keep their intensity are left alone by waveforms that do
+    // not drive them, so there is no need to generate frames for them.
+    // Recorded frames need to cover the whole region to be replayed from
+    // other intensities
+    if (
+        !compiled
+        && !drives_unchanged(*active.waveform)
+        && !this->shrink_update(active.update)
+    ) {
+        this->skip_update(active.update);
+        this->recycle_update(std::move(active.update));
+        return;
+    }
+
+    this->align_update(active.update);
+
+    // Use bitwise operations for black and white updates (as produced by
+    // A2 and DU, for example), packed lookup tables if the update contains
+    // few enough different transitions, otherwise fall back to looking up
+    // each cell
+    active.is_binary = this->scan_binary(active);
+
+    if (!active.is_binary) {
+        active.pixels_per_key = this->scan_transitions(active);
+
+        if (active.pixels_per_key > 0) {
+            active.transition_mask.fill(0);
+
+            for (auto transition : active.transitions) {
+                active.transition_mask[
+                    (transition >> 5) * 2 + ((transition >> 4) & 1)
+                ] |= std::uint32_t{3} << ((transition & 15) * 2);
+            }
+        } else {
+            this->check_consecutive(active);
+        }
+    }
+
+    if (!Display::trim_frames(active)) {
+        // No frame has any effect on this update
+        this->commit_update(active.update);
+        this->skip_update(active.update);
+        this->recycle_update(std::move(active.update));
+        return;
+    }
+
+    if (active.pixels_per_key > 0) {
+        this->pack_transitions(active);
+    }
+
+    if (compiled) {
+        this->start_recording(active);
+    }
+
+    push_active(std::move(active));
+}
+
+auto Display::start_replay(ActiveUpdate& active) -> bool
+{
+    const auto& update = active.update;
+    const auto& compiled = *update.compiled;
+    const auto& region = update.region;
+
+    // Recorded frames only apply to the same waveform, which changes
+    // with the temperature range
+    if (
+        compiled.waveform != active.waveform
+        || compiled.frame_region.top != region.top
+        || compiled.frame_region.left != region.left
+        || compiled.frame_region.width != region.width
+        || compiled.frame_region.height != region.height
+    ) {
         return false;
     }
 
-    std::copy(
-        next_update.id.cbegin(), next_update.id.cend(),
-        std::back_inserter(cur_update.id)
-    );
+    const Intensity* prev = this->current_intensity.data()
+        + region.top * epd_width
+        + region.left;
+    const Intensity* next = update.buffer.data();
+    const Intensity* recorded_next = compiled.frame_buffer.data();
+    const Intensity* recorded_prev = compiled.from_key.data();
+
+    for (std::size_t y = 0; y < region.height; ++y) {
+        for (std::size_t x = 0; x < region.width; ++x) {
+            if (
+                next[x] != recorded_next[x]
+                || compiled.equivalent_from[(prev[x] << 5) | next[x]]
+                    != recorded_prev[x]
+            ) {
+                return false;
+            }
+        }
+
+        prev += epd_width;
+        next += region.width;
+        recorded_next += region.width;
+        recorded_prev += region.width;
+    }
+
+    active.is_replay = true;
+    active.frame = compiled.frame_begin;
+    active.frame_end = compiled.frame_begin + compiled.sequence.size();
+    return true;
+}
+
+void Display::start_recording(ActiveUpdate& active)
+{
+    const auto& update = active.update;
+    const auto& region = update.region;
+    const auto& waveform = *active.waveform;
+    auto& compiled = *update.compiled;
+
+    compiled.waveform.reset();
+    compiled.equivalent_from = find_equivalent_sources(waveform);
+    compiled.frame_region = region;
+    compiled.frame_buffer = update.buffer;
+    compiled.from_key.resize(region.width * region.height);
+    compiled.frame_begin = active.frame;
+    compiled.images.clear();
+    compiled.image_hashes.clear();
+    compiled.sequence.clear();
+
+    const Intensity* prev = this->current_intensity.data()
+        + region.top * epd_width
+        + region.left;
+    const Intensity* next = update.buffer.data();
+    Intensity* key = compiled.from_key.data();
+
+    for (std::size_t y = 0; y < region.height; ++y) {
+        for (std::size_t x = 0; x < region.width; ++x) {
+            key[x] = compiled.equivalent_from[(prev[x] << 5) | next[x]];
+        }
+
+        prev += epd_width;
+        next += region.width;
+        key += region.width;
+    }
+
+    active.is_recording = true;
+}
+
+void Display::record_frame(ActiveUpdate& active, const std::uint8_t* frame)
+{
+    const auto& region = active.update.region;
+    auto& compiled = *active.update.compiled;
+    const std::size_t groups = region.width / buf_actual_depth;
+
+    std::vector<std::uint8_t> image(groups * 2 * region.height);
+    auto* target = image.data();
+    const std::uint8_t* data = frame
+        + (margin_top + region.top) * buf_stride
+        + (margin_left + region.left / buf_actual_depth) * buf_depth;
+
+    for (std::size_t y = 0; y < region.height; ++y) {
+        for (std::size_t x = 0; x < groups; ++x) {
+            *target++ = data[x * buf_depth];
+            *target++ = data[x * buf_depth + 1];
+        }
+
+        data += buf_stride;
+    }
+
+    // Waveforms often repeat the same frames, which only need to be
+    // stored once
+    const auto hash = std::hash<std::string_view>{}(std::string_view{
+        reinterpret_cast<const char*>(image.data()),
+        image.size()
+    });
+
+    for (std::size_t i = 0; i < compiled.images.size(); ++i) {
+        if (
+            compiled.image_hashes[i] == hash
+            && compiled.images[i] == image
+        ) {
+            compiled.sequence.push_back(i);
+            return;
+        }
+    }
+
+    compiled.sequence.push_back(compiled.images.size());
+    compiled.images.push_back(std::move(image));
+    compiled.image_hashes.push_back(hash);
+}
+
+void Display::write_frame_replay(
+    const ActiveUpdate& active,
+    std::uint8_t* data,
+    std::size_t row_begin,
+    std::size_t row_end
+)
+{
+    const auto& region = active.update.region;
+    const auto& compiled = *active.update.compiled;
+    const std::size_t groups = region.width / buf_actual_depth;
+    const auto& image = compiled.images[
+        compiled.sequence[active.frame - compiled.frame_begin]
+    ];
+    const std::uint8_t* source = image.data() + row_begin * groups * 2;
+    data += row_begin * buf_stride;
+
+    for (std::size_t y = row_begin; y < row_end; ++y) {
+        for (std::size_t x = 0; x < groups; ++x) {
+            data[x * buf_depth] = *source++;
+            data[x * buf_depth + 1] = *source++;
+        }
+
+        data += buf_stride;
+    }
+}
+
+void Display::generate_frame()
+{
+    std::uint8_t* frame = this->acquire_frame();
+
+    if (frame == nullptr) {
+        return;
+    }
+
+    const auto generate_start = chrono::steady_clock::now();
+
+    // Only restore the parts left over from the previous frame in this
+    // slot that will not be overwritten by the active updates
+    auto& dirty = this->frame_dirty[
+        this->frames_generated % buf_usable_frames
+    ];
+
+    for (const auto& active : this->active_updates) {
+        std::vector<Region> stale;
+
+        for (const auto& region : dirty) {
+            auto parts = subtract_region(region, active.update.region);
+            stale.insert(stale.end(), parts.cbegin(), parts.cend());
+        }
+
+        dirty = std::move(stale);
+    }
+
+    for (const auto& stale : dirty) {
+        this->restore_frame(frame, stale);
+    }
 
-    auto top = std::min(cur_update.region.top, next_update.region.top);
-    auto left = std::min(cur_update.region.left, next_update.region.left);
-    auto width = std::max(
-        cur_update.region.left + cur_update.region.width,
-        next_update.region.left + next_update.region.width
-    ) - left;
-    auto height = std::max(
-        cur_update.region.top + cur_update.region.height,
-        next_update.region.top + next_update.region.height
-    ) - top;
-
-    Region merged_region{top, left, width, height};
-
-    // Create merged buffer with overlayed current intensities,
-    // current update and merged update
-    std::vector<Intensity> merged_buffer(width * height);
+    dirty.clear();
 
-    copy_rect(
-        /* source = */ this->current_intensity.data(),
-        /* source_region = */ merged_region,
-        /* source_width = */ epd_width,
-        /* dest = */ merged_buffer.data(),
-        /* dest_top = */ 0,
-        /* dest_left = */ 0,
-        /* dest_width = */ width
-    );
+    for (const auto& active : this->active_updates) {
+        dirty.push_back(active.update.region);
+    }
 
-    copy_rect(
-        /* source = */ cur_update.buffer.data(),
-        /* source_region = */ Region{
-            0, 0,
-            cur_update.region.width, cur_update.region.height
-        },
-        /* source_width = */ cur_update.region.width,
-        /* dest = */ merged_buffer.data(),
-        /* dest_top = */ cur_update.region.top - merged_region.top,
-        /* dest_left = */ cur_update.region.left - merged_region.left,
-        /* dest_width = */ merged_region.width
-    );
+    this->write_frame(frame);
+    FrameInfo info;
 
-    copy_rect(
-        /* source = */ next_update.buffer.data(),
-        /* source_region = */ Region{
-            0, 0,
-            next_update.region.width, next_update.region.height
-        },
-        /* source_width = */ next_update.region.width,
-        /* dest = */ merged_buffer.data(),
-        /* dest_top = */ next_update.region.top - merged_region.top,
-        /* dest_left = */ next_update.region.left - merged_region.left,
-        /* dest_width = */ merged_region.width
+    for (auto& active : this->active_updates) {
+        if (active.is_recording) {
+            this->record_frame(active, frame);
+        }
+
+        ++active.frame;
+    }
+
+    if (this->trace.is_enabled()) {
+        TraceEvent event;
+        event.type = TraceEventType::Generate;
+        event.time = TraceEvent::now();
+        event.frame = this->frames_generated;
+        this->trace.record(event);
+    }
+
+    // Retire updates whose waveform is complete
+    auto it = this->active_updates.begin();
+
+    while (it != this->active_updates.end()) {
+        if (it->frame == it->frame_end) {
+            if (it->is_recording) {
+                it->update.compiled->waveform = it->waveform;
+            }
+
+            if (it->released.empty()) {
+                this->commit_update(it->update);
+            } else {
+                for (const auto& part : subtract_regions(
+                    it->update.region, it->released
+                )) {
+                    this->commit_region(it->update, part);
+                }
+            }
+
+            info.finished.insert(
+                info.finished.end(),
+                it->update.id.cbegin(), it->update.id.cend()
+            );
+
+            this->recycle_update(std::move(it->update));
+            it = this->active_updates.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    info.last = this->active_updates.empty();
+
+    std::size_t remaining = 0;
+
+    for (const auto& active : this->active_updates) {
+        remaining = std::max(remaining, active.frame_end - active.frame);
+    }
+
+    info.lead = this->compute_stream_lead(
+        chrono::steady_clock::now() - generate_start,
+        remaining
     );
 
-    cur_update.region = std::move(merged_region);
-    cur_update.buffer = std::move(merged_buffer);
+    this->publish_frame(std::move(info));
+}
 
-    this->pending_updates.pop();
-    return true;
+auto Display::compute_stream_lead(
+    chrono::steady_clock::duration duration,
+    std::size_t remaining
+) const -> std::size_t
+{
+    // Leave some margin for variations in generation time
+    const double generate = chrono::duration<double>(duration).count() * 1.25;
+    const double period = 1. / this->table.get_frame_rate();
+
+    if (generate <= period) {
+        return 1;
+    }
+
+    // Starting with L frames ready, the k-th remaining frame is ready k
+    // generation times after starting and needed L + k - 1 vsync periods
+    // after starting, which holds for all k up to the last one if
+    // L >= 1 + remaining * (generate - period) / period
+    return 1 + static_cast<std::size_t>(
+        std::ceil(remaining * (generate - period) / period)
+    );
 }
 
-void Display::align_update()
+void Display::write_frame(std::uint8_t* frame)
 {
-    constexpr auto mask = buf_actual_depth - 1;
-    auto& update = this->generate_update;
+    std::size_t cells = 0;
 
-    if (
-        (update.region.width & mask) == 0
-        && (update.region.left & mask) == 0
-    ) {
+    for (const auto& active : this->active_updates) {
+        cells += active.update.region.width * active.update.region.height;
+    }
+
+    if (this->worker_threads.empty() || cells < min_split_cells) {
+        this->write_band(frame, 0, 1);
         return;
     }
 
-    auto aligned_left = update.region.left & ~mask;
-    auto pad_left = update.region.left & mask;
-    auto new_width = (pad_left + update.region.width + mask) & ~mask;
-    auto pad_right = new_width - pad_left - update.region.width;
+    const std::size_t band_count = this->worker_threads.size() + 1;
 
-    std::vector<Intensity> new_buffer(update.region.height * new_width);
+    {
+        std::lock_guard<std::mutex> lock(this->workers_lock);
+        this->worker_frame = frame;
+        this->worker_band_count = band_count;
+        this->workers_pending = this->worker_threads.size();
+        ++this->worker_job;
+    }
 
-    const Intensity* prev = this->current_intensity.data()
-        + update.region.top * epd_width
-        + aligned_left;
+    this->workers_start_cv.notify_all();
+    this->write_band(frame, 0, band_count);
 
-    const Intensity* old_next = update.buffer.data();
-    Intensity* new_next = new_buffer.data();
+    std::unique_lock<std::mutex> lock(this->workers_lock);
+    this->workers_done_cv.wait(lock, [this] {
+        return this->workers_pending == 0;
+    });
+}
 
-    for (std::size_t y = 0; y < update.region.height; ++y) {
-        for (std::size_t x = 0; x < pad_left; ++x) {
-            *new_next++ = *prev++;
-        }
+void Display::write_band(
+    std::uint8_t* frame,
+    std::size_t band,
+    std::size_t band_count
+)
+{
+    // Split the frame rows rather than each update region, so that
+    // overlapping updates are written in order on each row
+    std::size_t top = epd_height;
+    std::size_t bottom = 0;
+
+    for (const auto& active : this->active_updates) {
+        const auto& region = active.update.region;
+        top = std::min<std::size_t>(top, region.top);
+        bottom = std::max<std::size_t>(bottom, region.top + region.height);
+    }
 
-        for (std::size_t x = 0; x < update.region.width; ++x) {
-            *new_next++ = *old_next++;
+    if (top >= bottom) {
+        return;
+    }
+
+    const std::size_t band_top = top + (bottom - top) * band / band_count;
+    const std::size_t band_bottom
+        = top + (bottom - top) * (band + 1) / band_count;
+
+    for (const auto& active : this->active_updates) {
+        const auto& region = active.update.region;
+        const auto& matrix = (*active.waveform)[active.frame];
+        const std::size_t row_begin = std::clamp<std::size_t>(
+            band_top, region.top, region.top + region.height
+        ) - region.top;
+        const std::size_t row_end = std::clamp<std::size_t>(
+            band_bottom, region.top, region.top + region.height
+        ) - region.top;
+
+        if (row_begin == row_end) {
+            continue;
         }
 
-        prev += update.region.width;
+        std::uint8_t* data = frame
+            + (margin_top + region.top) * buf_stride
+            + (margin_left + region.left / buf_actual_depth) * buf_depth;
 
-        for (std::size_t x = 0; x < pad_right; ++x) {
-            *new_next++ = *prev++;
+        if (active.is_replay) {
+            this->write_frame_replay(active, data, row_begin, row_end);
+        } else if (active.is_binary) {
+            this->write_frame_binary(active, matrix, data, row_begin, row_end);
+        } else if (active.pixels_per_key > 0) {
+            this->write_frame_lut(active, matrix, data, row_begin, row_end);
+        } else {
+            this->write_frame_direct(active, matrix, data, row_begin, row_end);
         }
+    }
+}
 
-        prev += epd_width - new_width;
+void Display::start_workers()
+{
+    this->stopping_workers = false;
+
+    for (std::size_t band = 1; band < this->generator_thread_count; ++band) {
+        this->worker_threads.emplace_back(
+            &Display::run_worker_thread, this, band
+        );
+        pthread_setname_np(
+            this->worker_threads.back().native_handle(),
+            "waved_worker"
+        );
     }
+}
 
-    update.buffer = std::move(new_buffer);
-    update.region.left = aligned_left;
-    update.region.width = new_width;
+void Display::stop_workers()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->workers_lock);
+        this->stopping_workers = true;
+    }
+
+    this->workers_start_cv.notify_all();
+
+    for (auto& worker : this->worker_threads) {
+        worker.join();
+    }
+
+    this->worker_threads.clear();
 }
 
-std::vector<bool> Display::check_consecutive()
+void Display::run_worker_thread(std::size_t band)
 {
-    const auto& update = this->generate_update;
-    const auto& region = update.region;
-    std::vector<bool> result(region.height * region.width / buf_actual_depth);
+    std::size_t last_job = 0;
 
-    const Intensity* prev_base = this->current_intensity.data()
-        + region.top * epd_width
-        + region.left;
-    const Intensity* next_base = update.buffer.data();
+    while (true) {
+        std::uint8_t* frame;
+        std::size_t band_count;
 
-    const Intensity* prev = prev_base;
-    const Intensity* next = next_base;
+        {
+            std::unique_lock<std::mutex> lock(this->workers_lock);
+            this->workers_start_cv.wait(lock, [this, last_job] {
+                return this->stopping_workers
+                    || this->worker_job != last_job;
+            });
 
-    bool first = true;
-    std::array<Intensity, buf_actual_depth> last_prevs;
-    std::array<Intensity, buf_actual_depth> last_nexts;
-    std::size_t i = 0;
+            if (this->stopping_workers) {
+                return;
+            }
 
-    for (std::size_t y = 0; y < region.height; ++y) {
-        for (std::size_t x = 0; x < region.width / buf_actual_depth; ++x) {
-            result[i] = (
-                !first
-                && std::equal(last_prevs.cbegin(), last_prevs.cend(), prev)
-                && std::equal(last_nexts.cbegin(), last_nexts.cend(), next)
-            );
+            last_job = this->worker_job;
+            frame = this->worker_frame;
+            band_count = this->worker_band_count;
+        }
 
-            first = false;
-            std::copy(prev, prev + buf_actual_depth, last_prevs.begin());
-            std::copy(next, next + buf_actual_depth, last_nexts.begin());
+        this->write_band(frame, band, band_count);
 
-            prev += buf_actual_depth;
-            next += buf_actual_depth;
-            ++i;
+        {
+            std::lock_guard<std::mutex> lock(this->workers_lock);
+
+            if (--this->workers_pending == 0) {
+                this->workers_done_cv.notify_one();
+            }
         }
+    }
+}
 
-        prev += epd_width - region.width;
+void Display::set_generator_thread_count(std::size_t count)
+{
+    this->generator_thread_count = std::max(count, std::size_t{1});
+}
+
+void Display::set_vsync_priority(int priority)
+{
+    this->vsync_priority = std::clamp(priority, 0, 99);
+}
+
+void Display::set_thread_affinity(
+    std::vector<unsigned> generator_cpus,
+    std::vector<unsigned> vsync_cpus
+)
+{
+    this->generator_cpus = std::move(generator_cpus);
+    this->vsync_cpus = std::move(vsync_cpus);
+}
+
+void Display::set_memory_locking(bool enabled)
+{
+    this->lock_memory = enabled;
+}
+
+auto Display::get_missed_vsync_count() const -> std::uint64_t
+{
+    return this->missed_vsyncs;
+}
+
+auto Display::acquire_frame() -> std::uint8_t*
+{
+#ifndef DRY_RUN
+    std::unique_lock<std::mutex> lock(this->frames_lock);
+    this->slots_free_cv.wait(lock, [this] {
+        return (
+            this->frames_generated - this->frames_released < buf_usable_frames
+            || this->stopping_generator
+        );
+    });
+
+    if (this->stopping_generator) {
+        return nullptr;
     }
+#endif // DRY_RUN
 
-    return result;
+    return this->framebuffer
+        + (this->frames_generated % buf_usable_frames) * buf_frame;
 }
 
-void Display::generate_frames()
+void Display::publish_frame(FrameInfo info)
 {
-    std::vector<bool> is_consecutive = this->check_consecutive();
-    auto& update = this->generate_update;
+#ifdef DRY_RUN
+    // Pretend that the frame was immediately sent
+    ++this->frames_generated;
+    this->frames_complete = this->frames_generated;
+    this->frames_vsynced = this->frames_generated;
+    this->frames_released = this->frames_generated;
+
+    if (!info.finished.empty()) {
+        this->complete_updates(info.finished);
+    }
+#else
+    {
+        std::lock_guard<std::mutex> lock(this->frames_lock);
+        const bool complete = !info.finished.empty();
+        this->stream_lead = info.lead;
+        this->frame_info[this->frames_generated % buf_usable_frames]
+            = std::move(info);
+        ++this->frames_generated;
+
+        if (complete) {
+            this->frames_complete = this->frames_generated;
+        }
+    }
+
+    this->frames_ready_cv.notify_one();
+#endif // DRY_RUN
+}
 
+void Display::commit_region(const Update& update, const Region& part)
+{
     const auto& region = update.region;
-    const Intensity* prev_base = this->current_intensity.data()
-        + region.top * epd_width
-        + region.left;
-    const Intensity* next_base = update.buffer.data();
-    const Waveform& waveform = this->table.lookup(
-        update.mode, this->temperature
-    );
 
-#if ENABLE_PERF_REPORT
-    update.generate_times.resize(waveform.size() + 1);
-    update.generate_times[0] = chrono::steady_clock::now();
-#endif // ENABLE_PERF_REPORT
+    copy_rect(
+        update.buffer.data(),
+        Region{
+            part.top - region.top,
+            part.left - region.left,
+            part.width,
+            part.height
+        },
+        region.width,
+        this->current_intensity.data(),
+        part.top,
+        part.left,
+        epd_width
+    );
+}
 
-    this->generate_buffer.clear();
-    this->generate_buffer.reserve(waveform.size());
+auto Display::is_released(ActiveUpdate& active, const Region& part) -> bool
+{
+    // Recorded frames cover the whole region, which must not be shared
+    // with the frames of other updates
+    if (active.is_replay || active.is_recording) {
+        return false;
+    }
 
-    for (std::size_t k = 0; k < waveform.size(); ++k) {
-        this->generate_buffer.emplace_back(this->null_frame);
-        std::uint8_t* data = this->generate_buffer.back().data()
-            + (margin_top + region.top) * buf_stride
-            + (margin_left + region.left / buf_actual_depth) * buf_depth;
+    // Frames generated cell by cell read the current intensities, which
+    // would no longer be those the update started from
+    if (!active.is_binary && active.pixels_per_key == 0) {
+        return false;
+    }
 
-        const auto& matrix = waveform[k];
-        const Intensity* prev = prev_base;
-        const Intensity* next = next_base;
+    const auto& update = active.update;
+    const auto& region = update.region;
+    const std::size_t groups = region.width / buf_actual_depth;
+
+    if (active.group_end.empty()) {
+        // Find the index following the last frame that drives each
+        // transition
+        std::array<std::uint16_t, intensity_values * intensity_values>
+            transition_end{};
+        const auto& waveform = *active.waveform;
+
+        for (std::size_t frame = 0; frame < active.frame_end; ++frame) {
+            const auto& words = waveform[frame].words;
+
+            for (std::size_t word = 0; word < words.size(); ++word) {
+                std::uint32_t driven = (words[word] | (words[word] >> 1))
+                    & 0x55555555;
+
+                while (driven != 0) {
+                    const auto to = ((word & 1) << 4)
+                        | (__builtin_ctz(driven) >> 1);
+                    transition_end[((word >> 1) << 5) | to] = frame + 1;
+                    driven &= driven - 1;
+                }
+            }
+        }
 
-        std::size_t i = 0;
-        std::uint8_t byte1 = 0;
-        std::uint8_t byte2 = 0;
+        // Intensities were not changed in the region since the update
+        // started, as only released parts get committed early
+        active.group_end.resize(groups * region.height);
+        auto* end = active.group_end.data();
+        const Intensity* prev = this->current_intensity.data()
+            + region.top * epd_width
+            + region.left;
+        const Intensity* next = update.buffer.data();
 
         for (std::size_t y = 0; y < region.height; ++y) {
-            for (std::size_t x = 0; x < region.width / buf_actual_depth; ++x) {
-                if (!is_consecutive[i]) {
-                    auto phase1 = matrix[*prev++][*next++];
-                    auto phase2 = matrix[*prev++][*next++];
-                    auto phase3 = matrix[*prev++][*next++];
-                    auto phase4 = matrix[*prev++][*next++];
-                    auto phase5 = matrix[*prev++][*next++];
-                    auto phase6 = matrix[*prev++][*next++];
-                    auto phase7 = matrix[*prev++][*next++];
-                    auto phase8 = matrix[*prev++][*next++];
-
-                    byte1 = (
-                        (static_cast<std::uint8_t>(phase5) << 6)
-                        | (static_cast<std::uint8_t>(phase6) << 4)
-                        | (static_cast<std::uint8_t>(phase7) << 2)
-                        | static_cast<std::uint8_t>(phase8)
-                    );
+            for (std::size_t x = 0; x < groups; ++x) {
+                std::uint16_t group = 0;
 
-                    byte2 = (
-                        (static_cast<std::uint8_t>(phase1) << 6)
-                        | (static_cast<std::uint8_t>(phase2) << 4)
-                        | (static_cast<std::uint8_t>(phase3) << 2)
-                        | static_cast<std::uint8_t>(phase4)
+                for (std::size_t k = 0; k < buf_actual_depth; ++k) {
+                    group = std::max(
+                        group, transition_end[(prev[k] << 5) | next[k]]
                     );
-                } else {
-                    prev += buf_actual_depth;
-                    next += buf_actual_depth;
                 }
 
-                *data++ = byte1;
-                *data++ = byte2;
-                data += 2;
-                ++i;
+                *end++ = group;
+                prev += buf_actual_depth;
+                next += buf_actual_depth;
             }
 
             prev += epd_width - region.width;
-            data += buf_stride - (region.width / buf_actual_depth) * buf_depth;
         }
-
-#ifdef ENABLE_PERF_REPORT
-        update.generate_times[k + 1] = chrono::steady_clock::now();
-#endif // ENABLE_PERF_REPORT
     }
 
-#ifndef DRY_RUN
-    {
-        std::unique_lock<std::mutex> lock(this->vsync_write_lock);
-        this->vsync_can_write_cv.wait(lock, [this] {
-            return this->vsync_can_write || this->stopping_generator;
-        });
-        this->vsync_update = this->generate_update;
-        std::swap(this->generate_buffer, this->vsync_buffer);
+    const std::size_t first = (part.left - region.left) / buf_actual_depth;
+    const std::size_t count = part.width / buf_actual_depth;
+
+    for (std::size_t y = part.top; y < part.top + part.height; ++y) {
+        const auto* end = active.group_end.data()
+            + (y - region.top) * groups + first;
+
+        for (std::size_t x = 0; x < count; ++x) {
+            if (end[x] > active.frame) {
+                return false;
+            }
+        }
     }
 
-    this->vsync_can_write = false;
-    this->vsync_can_read = true;
-    this->vsync_can_read_cv.notify_one();
-#else
-#ifdef ENABLE_PERF_REPORT
-    this->make_perf_record();
-#endif // ENABLE_PERF_REPORT
-#endif // DRY_RUN
+    return true;
 }
 
-void Display::commit_update()
+void Display::release_region(ActiveUpdate& active, const Region& part)
 {
-    const auto& update = this->generate_update;
-    const auto& region = update.region;
-
-    Intensity* prev = this->current_intensity.data()
-        + epd_width * region.top + region.left;
-    const Intensity* next = update.buffer.data();
-
-    for (std::size_t i = 0; i < region.height; ++i) {
-        std::copy(next, next + region.width, prev);
-        prev += epd_width;
-        next += region.width;
+    for (const auto& fresh : subtract_regions(part, active.released)) {
+        this->commit_region(active.update, fresh);
+        active.released.push_back(fresh);
     }
 }
 
+void Display::commit_update(const Update& update)
+{
+    this->commit_region(update, update.region);
+}
+
 void Display::run_vsync_thread()
 {
 #ifndef DRY_RUN
-    std::size_t next_frame = 0;
     bool first_frame = true;
 
+    // Time between two frames, in microseconds
+    const std::uint64_t frame_period = 1'000'000 / this->table.get_frame_rate();
+
+    // End of the last update stream
+    auto stream_end = chrono::steady_clock::now();
+
+    // Time from which the controller is kept on before switching it off
+    auto idle_start = stream_end;
+    auto idle_timeout = this->get_idle_timeout();
+
     while (!this->stopping_vsync) {
         {
             // Wait for the next update to be ready
-            std::unique_lock<std::mutex> lock(this->vsync_read_lock);
+            std::unique_lock<std::mutex> lock(this->frames_lock);
             const auto pred = [this] {
-                return this->vsync_can_read || this->stopping_vsync;
+                return (
+                    this->can_start_vsync()
+                    || this->stopping_vsync
+                    || this->power_hint
+                );
             };
 
-            if (!this->vsync_can_read_cv.wait_for(lock, power_off_timeout, pred)) {
-                // Turn off power to save battery when no updates are coming
-                this->set_power(false);
-                this->vsync_can_read_cv.wait(lock, pred);
+            for (;;) {
+                if (this->power_state) {
+                    if (!this->frames_ready_cv.wait_until(
+                        lock, idle_start + idle_timeout, pred
+                    )) {
+                        // Turn off power to save battery when no updates
+                        // are coming, without blocking the generator thread
+                        lock.unlock();
+                        this->set_power(false);
+                        lock.lock();
+                        continue;
+                    }
+                } else {
+                    this->frames_ready_cv.wait(lock, pred);
+                }
+
+                if (this->stopping_vsync) {
+                    return;
+                }
+
+                if (!this->power_hint) {
+                    break;
+                }
+
+                // Power on ahead of the expected updates, without blocking
+                // the generator thread
+                this->power_hint = false;
+                idle_start = chrono::steady_clock::now();
+
+                if (!this->power_state) {
+                    lock.unlock();
+                    this->set_power(true);
+                    lock.lock();
+                }
+
+                if (this->can_start_vsync()) {
+                    break;
+                }
             }
         }
 
-        if (this->stopping_vsync) {
-            return;
-        }
+        const auto stream_start = chrono::steady_clock::now();
+        this->idle_history[this->idle_history_count % idle_history_size]
+            = stream_start - stream_end;
+        ++this->idle_history_count;
+
+        // Start of the current frame vsync, in microseconds
+        auto vsync_start = TraceEvent::now();
+
+        // Number of frames sent in this stream
+        std::size_t stream_frames = 0;
 
-#if ENABLE_PERF_REPORT
-        Update& update = this->vsync_update;
-        update.vsync_times.resize(this->vsync_buffer.size() + 1);
-        update.vsync_times[0] = chrono::steady_clock::now();
-#endif // ENABLE_PERF_REPORT
+        // Whether this stream was started on the lead estimate alone, and
+        // whether the generator fell behind during it
+        bool on_lead = false;
+        bool lead_missed = false;
+
+        {
+            std::lock_guard<std::mutex> lock(this->frames_lock);
+            on_lead = !this->can_start_vsync_safely();
+        }
 
         this->set_power(true);
-        this->update_temperature();
 
-        for (std::size_t k = 0; k < this->vsync_buffer.size(); ++k) {
-            next_frame = (next_frame + 1) % 2;
+        bool last = false;
+
+        while (!last) {
+            std::uint64_t frame;
+            FrameInfo info;
+
+            // Whether the generator fell behind on this frame
+            bool underrun = false;
+
+            {
+                // Wait for the next frame of the stream to be generated
+                std::unique_lock<std::mutex> lock(this->frames_lock);
+
+                if (
+                    on_lead
+                    && this->frames_generated == this->frames_vsynced
+                ) {
+                    // The generator fell behind, and the null frame is
+                    // shown until it catches up, which stretches the drive
+                    // timing of all updates in flight
+                    lead_missed = true;
+                    underrun = true;
+                    ++this->missed_vsyncs;
+                }
+
+                this->frames_ready_cv.wait(lock, [this] {
+                    return (
+                        this->frames_generated > this->frames_vsynced
+                        || this->stopping_vsync
+                    );
+                });
 
-            std::memcpy(
-                this->framebuffer + next_frame * buf_frame,
-                this->vsync_buffer[k].data(),
-                this->vsync_buffer[k].size()
-            );
+                if (this->stopping_vsync) {
+                    return;
+                }
 
-            this->var_info.yoffset = next_frame * buf_height;
+                frame = this->frames_vsynced;
+                auto& slot = this->frame_info[frame % buf_usable_frames];
+                info = std::move(slot);
+
+                // Updates that produce no frames can be attached to this
+                // slot until it is sent (see `skip_update()`)
+                slot.finished.clear();
+            }
+
+            this->var_info.yoffset = (frame % buf_usable_frames) * buf_height;
 
             if (
                 ioctl(
@@ -855,67 +3547,133 @@ void Display::run_vsync_thread()
             }
 
             first_frame = false;
+            last = info.last;
+
+            {
+                // The slot panned two frames ago is now off the screen
+                std::lock_guard<std::mutex> lock(this->frames_lock);
+                ++this->frames_vsynced;
 
-#ifdef ENABLE_PERF_REPORT
-            update.vsync_times[k + 1] = chrono::steady_clock::now();
-#endif // ENABLE_PERF_REPORT
+                if (this->frames_vsynced >= 2) {
+                    this->frames_released = this->frames_vsynced - 2;
+                }
+
+                auto& slot = this->frame_info[frame % buf_usable_frames];
+                info.finished.insert(
+                    info.finished.end(),
+                    slot.finished.cbegin(), slot.finished.cend()
+                );
+                slot.finished.clear();
+            }
+
+            this->slots_free_cv.notify_one();
+
+            const auto vsync_end = TraceEvent::now();
+
+            // Since each pan waits for the vsync of the previous frame,
+            // frames are sent one period apart unless the generator or
+            // this thread fell behind. The first pan of a stream does not
+            // wait for a previous frame, and underruns are already counted
+            if (
+                !underrun
+                && stream_frames >= 1
+                && (vsync_end - vsync_start) * 2 > frame_period * 3
+            ) {
+                ++this->missed_vsyncs;
+            }
+
+            ++stream_frames;
+
+            if (this->trace.is_enabled()) {
+                TraceEvent event;
+                event.type = TraceEventType::Vsync;
+                event.time = vsync_end;
+                event.frame = frame;
+                event.value = vsync_end - vsync_start;
+                this->trace.record(event);
+            }
+
+            vsync_start = vsync_end;
+
+            if (!info.finished.empty()) {
+                this->complete_updates(info.finished);
+            }
         }
 
-#ifdef ENABLE_PERF_REPORT
-        this->make_perf_record();
-#endif // ENABLE_PERF_REPORT
+        if (on_lead) {
+            std::lock_guard<std::mutex> lock(this->frames_lock);
+            this->adjust_lead_scale(lead_missed);
+        }
 
-        this->vsync_can_write = true;
-        this->vsync_can_read = false;
-        this->vsync_can_write_cv.notify_one();
+        stream_end = chrono::steady_clock::now();
+        idle_start = stream_end;
+        idle_timeout = this->get_idle_timeout();
     }
 #endif // DRY_RUN
 }
 
+auto Display::can_start_vsync() const -> bool
+{
+    return (
+        this->can_start_vsync_safely()
+        || this->frames_generated - this->frames_vsynced
+            >= this->stream_lead * this->lead_scale
+    );
+}
+
+auto Display::can_start_vsync_safely() const -> bool
+{
+    return (
+        this->frames_complete > this->frames_vsynced
+        || this->frames_generated - this->frames_released == buf_usable_frames
+    );
+}
+
+void Display::adjust_lead_scale(bool missed)
+{
+    if (missed) {
+        this->lead_scale = std::min<std::size_t>(
+            this->lead_scale * 2, buf_usable_frames
+        );
+        this->lead_clean_streams = 0;
+    } else if (this->lead_scale > 1) {
+        ++this->lead_clean_streams;
+
+        if (this->lead_clean_streams >= lead_decay_streams) {
+            this->lead_scale /= 2;
+            this->lead_clean_streams = 0;
+        }
+    }
+}
+
 void Display::reset_frame(std::size_t frame_index)
 {
-#ifndef DRY_RUN
     std::copy(
         this->null_frame.cbegin(),
         this->null_frame.cend(),
         this->framebuffer + buf_frame * frame_index
     );
-#endif // DRY_RUN
-}
 
-#ifdef ENABLE_PERF_REPORT
-void Display::make_perf_record()
-{
-#ifdef DRY_RUN
-    const auto& update = this->generate_update;
-    this->perf_report << update.id << ','
-        << static_cast<int>(update.mode) << ','
-        << update.region.width << ','
-        << update.region.height << ','
-        << update.queue_time << ','
-        << update.dequeue_time << ','
-        << update.generate_times << ",\n";
-#else
-    const auto& update = this->vsync_update;
-    this->perf_report << update.id << ','
-        << static_cast<int>(update.mode) << ','
-        << update.region.width << ','
-        << update.region.height << ','
-        << update.queue_time << ','
-        << update.dequeue_time << ','
-        << update.generate_times << ','
-        << update.vsync_times << '\n';
-#endif // DRY_RUN
+    if (frame_index < buf_usable_frames) {
+        this->frame_dirty[frame_index].clear();
+    }
 }
 
-std::string Display::get_perf_report() const
+void Display::restore_frame(std::uint8_t* frame, const Region& region)
 {
-    return (
-        "id,mode,width,height,queue_time,dequeue_time,"
-        "generate_times,vsync_times\n"
-        + this->perf_report.str()
-    );
+    const std::size_t offset = (margin_top + region.top) * buf_stride
+        + (margin_left + region.left / buf_actual_depth) * buf_depth;
+    const std::size_t length = region.width / buf_actual_depth * buf_depth;
+
+    const std::uint8_t* source = this->null_frame.data() + offset;
+    std::uint8_t* dest = frame + offset;
+
+    for (std::size_t y = 0; y < region.height; ++y) {
+        std::copy(source, source + length, dest);
+        source += buf_stride;
+        dest += buf_stride;
+    }
 }
-#endif // ENABLE_PERF_REPORT
+
 
 } // namespace Waved
@@ -9,24 +9,30 @@
 
 #include "defs.hpp"
 #include "file_descriptor.hpp"
+#include "trace.hpp"
 #include "waveform_table.hpp"
 #include <atomic>
 #include <optional>
 #include <array>
 #include <condition_variable>
 #include <mutex>
-#include <queue>
+#include <deque>
 #include <chrono>
 #include <thread>
 #include <cstdlib>
-#include <sstream>
+#include <string>
 #include <cstdint>
+#include <functional>
+#include <memory>
+#include <set>
 #include <vector>
 #include <linux/fb.h>
 
 namespace Waved
 {
 
+class CompiledUpdate;
+
 /**
  * Interface for the display controller.
  *
@@ -64,8 +70,9 @@ public:
      *
      * This method will power on the display controller and process updates
      * added to the queue using `push_update()` continuously from a background
-     * thread. If no updates are received for `power_off_timeout` ticks, the
-     * controller is switched off to save power. Calling `stop()` or destroying
+     * thread. If no updates are received for a while (see
+     * `set_power_off_timeout()`), the controller is switched off to save
+     * power. Calling `stop()` or destroying
      * this object will stop the background threads and updates remaining
      * in the queue will not be processed.
      */
@@ -74,47 +81,294 @@ public:
     /** Stop processing updates. */
     void stop();
 
+    /**
+     * Identifier for an update, increasing in the order of the queue.
+     *
+     * IDs are 64-bit wide even on 32-bit targets so that they never wrap
+     * around, which keeps them ordered for `wait_for()`.
+     */
+    using UpdateID = std::uint64_t;
+
     /**
      * Add an update to the queue.
      *
+     * Updates whose regions do not overlap with those of updates being
+     * displayed are started right away, even if they use a different mode,
+     * and progress through their waveform in parallel. Overlapping updates
+     * are applied in the order they were queued.
+     *
+     * This method never blocks and only allocates memory if the incoming
+     * buffers of the queue are too small for the update.
+     *
      * @param mode Update mode to use (ID or kind).
      * @param region Coordinates of the region affected by the update.
      * @param buffer New values for the pixels in the updated region.
-     * @return True if the update was pushed, false if it was deemed invalid.
+     * @return ID of the pushed update, or nothing if it was deemed invalid
+     * or if the queue is full.
      */
-    bool push_update(
+    std::optional<UpdateID> push_update(
         ModeKind mode,
         Region region,
         const std::vector<Intensity>& buffer
     );
-    bool push_update(
+    std::optional<UpdateID> push_update(
         ModeID mode,
         Region region,
         const std::vector<Intensity>& buffer
     );
 
-#ifdef ENABLE_PERF_REPORT
     /**
-     * Get the performance report for past updates as a CSV string.
+     * Add an update to the queue, reading its pixels from a caller-owned
+     * image in any supported format.
+     *
+     * The image is read in place and converted as part of the transform to
+     * the display coordinates, without any intermediate copy. It can be
+     * released or modified as soon as this method returns.
+     *
+     * @param mode Update mode to use (ID or kind).
+     * @param region Coordinates of the region affected by the update.
+     * @param data Pointer to the first pixel of the updated region.
+     * @param stride Number of bytes between the starts of two rows.
+     * @param format Format of the pixels.
+     * @return ID of the pushed update, or nothing if it was deemed invalid
+     * or if the queue is full.
+     */
+    std::optional<UpdateID> push_update(
+        ModeKind mode,
+        Region region,
+        const void* data,
+        std::size_t stride,
+        PixelFormat format
+    );
+    std::optional<UpdateID> push_update(
+        ModeID mode,
+        Region region,
+        const void* data,
+        std::size_t stride,
+        PixelFormat format
+    );
+
+    /**
+     * Prepare an update that gets displayed repeatedly, such as a screen
+     * clear or an icon switching between two states.
      *
-     * The CSV document will contain one row per processed update (or batch of
-     * updates merged together), with the following information:
+     * The pixels are converted once, as in `push_update()`. The frames
+     * generated the first time the compiled update is pushed are recorded,
+     * and later pushes copy them to the framebuffer instead of generating
+     * them again, as long as the panel stays in the same temperature range
+     * and the cells of the region start from intensities that receive the
+     * same phases as when recording. Otherwise, the frames are generated
+     * and recorded again.
      *
-     * ids - Unique IDs of updates in this batch
-     * mode - Update mode used
-     * width -  Width of the update rectangle
-     * height - Height of the update rectangle
-     * queue_time - Timestamp when the update was queued
-     * dequeue_time - Timestamp when the update started being processed
-     * generate_times - List of timestamps when each frame generation
-     *     was finished
-     * vsync_times - List of timestamps when each frame vsync was finished
+     * Recorded frames take two bytes per group of 8 cells of the region
+     * for each distinct frame of the waveform.
      *
-     * Fields that contain a variable number of values (ids, generate_times,
-     * and vsync_times) are colon-separated.
+     * @param mode Update mode to use (ID or kind).
+     * @param region Coordinates of the region affected by the update.
+     * @param data Pointer to the first pixel of the updated region.
+     * @param stride Number of bytes between the starts of two rows.
+     * @param format Format of the pixels.
+     * @return Compiled update, or nullptr if it was deemed invalid.
      */
-    std::string get_perf_report() const;
-#endif
+    std::shared_ptr<CompiledUpdate> compile_update(
+        ModeKind mode,
+        Region region,
+        const void* data,
+        std::size_t stride,
+        PixelFormat format
+    );
+    std::shared_ptr<CompiledUpdate> compile_update(
+        ModeID mode,
+        Region region,
+        const void* data,
+        std::size_t stride,
+        PixelFormat format
+    );
+
+    /**
+     * Add a compiled update to the queue (see `compile_update()`).
+     *
+     * If the update gets merged with other pending updates, frames for the
+     * merged update are generated as usual and nothing is recorded.
+     *
+     * @param update Compiled update to display.
+     * @return ID of the pushed update, or nothing if the queue is full.
+     */
+    std::optional<UpdateID> push_update(
+        std::shared_ptr<CompiledUpdate> update
+    );
+
+    /**
+     * Wait until an update has been displayed.
+     *
+     * An update is displayed once the last frame of its waveform has been
+     * sent to the display controller. Updates that turn out to leave the
+     * display unchanged are displayed once the frames generated before them
+     * have been sent. Updates merged together are displayed at the same time.
+     *
+     * @param id ID of the update returned by `push_update()`.
+     * @return True if the update was displayed, false if the display was
+     * stopped before.
+     */
+    bool wait_for(UpdateID id);
+
+    /**
+     * Set a function to call each time an update has been displayed.
+     *
+     * The function is called with the ID of the update from one of the
+     * processing threads, usually the one that sends frames to the display
+     * controller as soon as the last frame of the update is sent, and before
+     * `wait_for()` returns for that update. It must return quickly to avoid
+     * delaying the next frames. Must be called before `start()`.
+     *
+     * @param callback Function to call, or an empty function to disable.
+     */
+    void set_completion_callback(std::function<void(UpdateID)> callback);
+
+    /**
+     * Set the maximum share of wasted area allowed when merging updates.
+     *
+     * Pending updates in a compatible mode are merged into a single update
+     * covering their bounding box if the share of that box which is covered
+     * by neither update does not exceed this threshold. Otherwise, they are
+     * kept as separate regions displayed in parallel. Updates that overlap
+     * and use the same mode are merged regardless of this threshold.
+     *
+     * Updates in different modes are merged using the mode with the
+     * highest fidelity, within this threshold. Updates that do not overlap
+     * are further only merged this way if it takes no more frames times
+     * area than displaying them separately.
+     *
+     * @param threshold Share of wasted area, between 0 and 1.
+     */
+    void set_merge_waste_threshold(float threshold);
+    float get_merge_waste_threshold() const;
+
+    /**
+     * Get the number of frames that were sent late to the controller since
+     * the display was opened.
+     *
+     * A frame is late if the time since the previous frame was sent
+     * exceeds one and a half frame periods, in which case the controller
+     * showed the previous frame again or fell back onto the null frame,
+     * or if it was not generated yet when needed in a stream that was
+     * started before its updates were fully generated.
+     */
+    std::uint64_t get_missed_vsync_count() const;
+
+    /**
+     * Set the number of threads used to generate frames.
+     *
+     * Frames covering a large enough area are split in horizontal bands
+     * which are written in parallel by this many threads. Defaults to the
+     * number of available CPU cores. Must be called before `start()`.
+     *
+     * @param count Number of threads, including the generator thread.
+     */
+    void set_generator_thread_count(std::size_t count);
+
+    /**
+     * Set the real-time priority of the vsync thread.
+     *
+     * A nonzero priority runs the vsync thread under the SCHED_FIFO policy,
+     * so that other processes do not delay the sending of frames past
+     * the controller deadline. Defaults to 0, which uses the default
+     * scheduling policy. Must be called before `start()`.
+     *
+     * @param priority SCHED_FIFO priority, from 1 to 99, or 0.
+     */
+    void set_vsync_priority(int priority);
+
+    /**
+     * Set the CPU cores on which the generator and vsync threads can run.
+     *
+     * Empty sets, the default, leave the threads free to run on any core.
+     * Worker threads are not pinned. Must be called before `start()`.
+     *
+     * @param generator_cpus Cores for the generator thread.
+     * @param vsync_cpus Cores for the vsync thread.
+     */
+    void set_thread_affinity(
+        std::vector<unsigned> generator_cpus,
+        std::vector<unsigned> vsync_cpus
+    );
+
+    /**
+     * Set whether to lock the framebuffer mapping and the display state,
+     * including waveform tables, into memory, so that page faults do not
+     * delay frames.
+     *
+     * This locks all current and future memory of the process, until
+     * `stop()` unlocks it. Disabled by default. Must be called before
+     * `start()`.
+     */
+    void set_memory_locking(bool enabled);
+
+    /**
+     * Enable or disable dithering of updates given as Y8 or RGB565 pixels.
+     *
+     * When enabled, those pixels are converted to the gray levels that the
+     * update mode can display (2 for DU and A2, 4 for DU4, and 16 for other
+     * modes) using an ordered dither, instead of being mapped directly to
+     * one of the 16 intensities. Disabled by default.
+     */
+    void set_dithering(bool enabled);
+    bool get_dithering() const;
+
+    /**
+     * Set the maximum time to keep the display controller powered on after
+     * an update when no other updates are received.
+     *
+     * The gaps between recent updates are used to switch the controller off
+     * earlier when waiting for the full timeout is unlikely to save powering
+     * it on again. Defaults to 3 seconds.
+     *
+     * @param timeout Maximum time to keep the controller on.
+     */
+    void set_power_off_timeout(std::chrono::milliseconds timeout);
+    std::chrono::milliseconds get_power_off_timeout() const;
+
+    /**
+     * Signal that updates are likely to be received soon.
+     *
+     * This powers on the display controller ahead of time if needed, so that
+     * the next update does not have to wait for it, and restarts the power
+     * off timeout. It can be called from any thread, for example when a pen
+     * gets close to the screen.
+     */
+    void hint_activity();
+
+    /**
+     * Enable or disable tracing.
+     *
+     * When enabled, timed events about the processing of updates and
+     * frames, the controller power and the panel temperature are recorded
+     * into a fixed-size ring, which can be read using `pull_trace()` or
+     * `get_perf_report()`. When disabled (the default), recording an event
+     * only costs an atomic load.
+     */
+    void set_tracing(bool enabled);
+    bool get_tracing() const;
+
+    /**
+     * Retrieve the trace events recorded since the last call to this method
+     * or to `get_perf_report()`.
+     *
+     * Events that were not retrieved before the ring wrapped around are lost.
+     */
+    std::vector<TraceEvent> pull_trace();
+
+    /**
+     * Get a performance report for the updates displayed since the last
+     * call, as a CSV string (see `PerfReport` for the format).
+     *
+     * This consumes the trace events recorded since the last call to this
+     * method or to `pull_trace()`, and needs to be called often enough to
+     * avoid losing events while tracing is enabled.
+     *
+     * @param include_header Whether to start the report with a header row.
+     */
+    std::string get_perf_report(bool include_header = true);
 
 private:
     // Display-specific waveform information
@@ -133,8 +387,30 @@ private:
     // Pointer to the mmap’ed framebuffer
     std::uint8_t* framebuffer = nullptr;
 
-    // Time after which to switch the controller off if no updates are received
-    static constexpr std::chrono::milliseconds power_off_timeout{3000};
+    // See `set_power_off_timeout()`
+    std::atomic<std::chrono::milliseconds> power_off_timeout{
+        std::chrono::milliseconds{3000}
+    };
+
+    // Shortest time to keep the controller on after an update
+    static constexpr std::chrono::milliseconds min_power_off_timeout{250};
+
+    // Gaps between the end of an update stream and the start of the next
+    // one, as a ring of the most recent ones, used by the vsync thread to
+    // adapt the power off timeout
+    static constexpr std::size_t idle_history_size = 32;
+    std::array<std::chrono::steady_clock::duration, idle_history_size>
+        idle_history{};
+    std::size_t idle_history_count = 0;
+
+    /**
+     * Compute how long to keep the controller on after an update stream,
+     * based on the recent gaps between streams.
+     */
+    std::chrono::steady_clock::duration get_idle_timeout() const;
+
+    // Set by `hint_activity()`, protected by `frames_lock`
+    bool power_hint = false;
 
     // True if the display is powered on
     bool power_state = false;
@@ -148,12 +424,54 @@ private:
     // File descriptor for reading the panel temperature
     FileDescriptor temp_sensor_fd;
 
-    // Last panel temperature reading and timestamp
-    int temperature = 0;
-    std::chrono::steady_clock::time_point temperature_last_read;
+    // Last panel temperature reading and index of its range in the
+    // waveform table
+    std::atomic<int> temperature = 0;
+    std::size_t temperature_range = 0;
 
-    /** Update the panel temperature reading, if needed. */
-    void update_temperature();
+    /**
+     * Read the current panel temperature.
+     *
+     * @throws std::system_error If the temperature file cannot be read.
+     */
+    int read_temperature();
+
+    /**
+     * Take a temperature reading and, if it falls into another range than
+     * the previous one, resolve the waveforms of all modes for that range.
+     *
+     * @param force True to resolve waveforms even if the range is unchanged.
+     * @throws std::system_error If the temperature file cannot be read.
+     */
+    void update_temperature(bool force = false);
+
+    // Waveform to use for each mode at the current temperature, replaced
+    // as a whole by the temperature thread and protected by `waveforms_lock`
+    using ModeWaveforms = std::vector<std::shared_ptr<const Waveform>>;
+    std::shared_ptr<const ModeWaveforms> waveforms;
+    std::mutex waveforms_lock;
+
+    /** Get the waveform to use for a mode at the current temperature. */
+    std::shared_ptr<const Waveform> get_waveform(ModeID mode);
+
+    /**
+     * Thread that periodically takes panel temperature readings while the
+     * display controller is powered on, and once each time it is powered
+     * on.
+     */
+    std::thread temperature_thread;
+    void run_temperature_thread();
+
+    // Signal for stopping the temperature thread, and for changes of the
+    // controller power
+    std::mutex temperature_lock;
+    std::condition_variable temperature_cv;
+    bool stopping_temperature = false;
+
+    // Copy of `power_state` for the temperature thread, and whether a
+    // reading is needed right away since the controller was powered on
+    bool temperature_powered = false;
+    bool temperature_requested = false;
 
     // Structures used for communicating with the display controller
     fb_var_screeninfo var_info{};
@@ -238,11 +556,6 @@ private:
     // Buffer holding the current known intensity state of all display cells
     std::array<Intensity, epd_size> current_intensity{};
 
-    /** Identifier for an update being processed. */
-    using UpdateID = std::uint32_t;
-
-    static UpdateID next_update_id;
-
     /** Information about a display update being processed. */
     struct Update
     {
@@ -251,7 +564,7 @@ private:
         std::vector<UpdateID> id;
 
         // Update mode
-        ModeID mode;
+        ModeID mode = 0;
 
         // Coordinates of the region affected by the update
         Region region{};
@@ -259,110 +572,771 @@ private:
         // Buffer containing the new intensities of the region
         std::vector<Intensity> buffer;
 
-#ifdef ENABLE_PERF_REPORT
-        // Time of creation and addition to the update queue
-        std::chrono::steady_clock::time_point queue_time;
+        // Compiled update this update was pushed from, if it was not
+        // merged with other updates
+        std::shared_ptr<CompiledUpdate> compiled;
+    };
+
+    // Number of slots in the queue of incoming updates
+    static constexpr std::size_t update_ring_size = 64;
+
+    // Maximum capacity of the buffers of recycled updates. Larger buffers
+    // are released to avoid holding on to too much memory
+    static constexpr std::size_t max_pooled_buffer = epd_size / 16;
+
+    /** Slot from the queue of incoming updates. */
+    struct UpdateSlot
+    {
+        // Slot position in the ring if it is free for writing, or slot
+        // position plus one if it contains an update ready for reading
+        std::atomic<UpdateID> sequence;
+
+        Update update;
+    };
+
+    /**
+     * Transform an update region from reMarkable coordinates to the
+     * display coordinates.
+     *
+     * @return Transformed region, or nothing if it is out of bounds.
+     */
+    static std::optional<Region> to_display_region(const Region& region);
+
+    /**
+     * Convert the pixels of an update to intensities in the display
+     * coordinates.
+     *
+     * @param mode Update mode.
+     * @param region Update region, in reMarkable coordinates.
+     * @param trans_region Update region, in display coordinates.
+     * @param data Pointer to the first pixel of the updated region.
+     * @param stride Number of bytes between the starts of two rows.
+     * @param format Format of the pixels.
+     * @param dest Destination buffer, with `trans_region.width` cells
+     * per row.
+     */
+    void convert_pixels(
+        ModeID mode,
+        const Region& region,
+        const Region& trans_region,
+        const void* data,
+        std::size_t stride,
+        PixelFormat format,
+        Intensity* dest
+    ) const;
+
+    /**
+     * Claim a free slot in the incoming queue.
+     *
+     * @param position Receives the slot position, used as the update ID.
+     * @return Claimed slot, or nullptr if the queue is full.
+     */
+    UpdateSlot* claim_slot(UpdateID& position);
+
+    /**
+     * Make the update written to a claimed slot available to the generator
+     * thread.
+     *
+     * @param slot Claimed slot.
+     * @param position Slot position.
+     * @param transform_start Time when the conversion of the update pixels
+     * started, or 0 if tracing is disabled.
+     */
+    void publish_slot(
+        UpdateSlot& slot,
+        UpdateID position,
+        std::uint64_t transform_start
+    );
 
-        // Time of removal from the update queue
-        std::chrono::steady_clock::time_point dequeue_time;
+    // Bounded, lock-free queue of incoming updates, written to by any thread
+    // calling `push_update()` and read by the generator thread
+    std::array<UpdateSlot, update_ring_size> update_ring;
 
-        // Frame generation start time and individual frame end times
-        std::vector<std::chrono::steady_clock::time_point> generate_times;
+    // Position at which the next incoming update will be written
+    std::atomic<UpdateID> update_ring_head = 0;
 
-        // Vsync start time and individual frame end times
-        std::vector<std::chrono::steady_clock::time_point> vsync_times;
-#endif // ENABLE_PERF_REPORT
+    // Position from which the next incoming update will be read
+    UpdateID update_ring_tail = 0;
+
+    // Event used to wake up the generator thread when it is waiting
+    // for incoming updates
+    FileDescriptor update_event_fd;
+    std::atomic<bool> generator_waiting = false;
+
+    // Updates read from the incoming queue and waiting to be started
+    std::deque<Update> pending_updates;
+
+    // Updates whose memory can be reused for incoming updates
+    std::vector<Update> free_updates;
+
+    // Maximum number of distinct transitions in an update for which frames
+    // can be generated through packed lookup tables
+    static constexpr std::size_t max_lut_transitions = 256;
+
+    // Maximum number of updates being generated at the same time, past which
+    // further updates are merged regardless of the wasted area, or wait
+    static constexpr std::size_t max_active_updates = 8;
+
+    // See `set_merge_waste_threshold()`
+    std::atomic<float> merge_waste_threshold = 0.5;
+
+    // See `set_dithering()`
+    std::atomic<bool> dithering = false;
+
+    // Marker for transitions that are absent from an update
+    static constexpr std::uint16_t no_transition = 0xFFFF;
+
+    /**
+     * Information about an update whose frames are being generated.
+     *
+     * Several updates can be active at the same time as long as their
+     * regions do not overlap, each one progressing through its own
+     * waveform in the shared stream of frames.
+     */
+    struct ActiveUpdate
+    {
+        Update update;
+
+        // Waveform used for this update
+        std::shared_ptr<const Waveform> waveform;
+
+        // Index of the next frame to generate in the waveform
+        std::size_t frame = 0;
+
+        // Index following the last frame to generate in the waveform.
+        // Leading and trailing frames that leave all cells of the update
+        // unchanged are skipped
+        std::size_t frame_end = 0;
+
+        // Number of cells whose transition IDs are packed in each key, or 0
+        // if frames are generated by looking up each cell individually
+        std::size_t pixels_per_key = 0;
+
+        // Compact ID assigned to each (prev, next) intensity pair that is
+        // present in the update, indexed by `(prev << 5) | next`
+        std::array<std::uint16_t, intensity_values * intensity_values>
+            transition_ids;
+
+        // List of (prev, next) intensity pairs present in the update,
+        // indexed by their compact ID
+        std::vector<std::uint16_t> transitions;
+
+        // Transition IDs of the update, packed into one byte per group
+        // of cells and laid out in the same order as the frame bytes
+        std::vector<std::uint8_t> transition_keys;
+
+        // Result of `check_consecutive()`, when not using lookup tables
+        std::vector<bool> is_consecutive;
+
+        // Whether all cells of the update go from and to either black or
+        // white, in which case frames are generated from `binary_planes`
+        bool is_binary = false;
+
+        // For each group of cells, which cells are white before (lower 16
+        // bits) and after (upper 16 bits) the update, as 2-bit masks laid
+        // out in the same order as the two frame bytes of the group
+        std::vector<std::uint32_t> binary_planes;
+
+        // Set of (prev, next) intensity pairs present in the update, laid
+        // out like the words of a `PhaseMatrix` with both bits of each
+        // present pair set
+        std::array<std::uint32_t, intensity_values * 2> transition_mask{};
+
+        // For each group of cells, index following the last frame that
+        // drives any of its cells. Computed on demand by `is_released()`
+        std::vector<std::uint16_t> group_end;
+
+        // Parts of the region whose cells finished transitioning and were
+        // handed over to later updates. Their intensities are already
+        // committed and must not be committed again
+        std::vector<Region> released;
+
+        // For compiled updates, whether frames are copied from the ones
+        // recorded before or recorded while being generated
+        bool is_replay = false;
+        bool is_recording = false;
     };
 
-    // Queue of pending updates
-    std::queue<Update> pending_updates;
-    std::condition_variable updates_cv;
-    std::mutex updates_lock;
+    // Updates whose frames are being generated
+    std::vector<ActiveUpdate> active_updates;
 
     // Frame that leaves cell intensities unchanged
     Frame null_frame{};
 
-    // Buffer to which to generator thread will write to generate frames
-    // for each update
-    std::vector<Frame> generate_buffer{};
+#ifdef DRY_RUN
+    // Memory standing in for the framebuffer when not using the display
+    std::vector<std::uint8_t> dry_run_framebuffer;
+#endif // DRY_RUN
+
+    // Frames are generated directly into the usable framebuffer slots, which
+    // are used as a ring: frame number N is written to slot
+    // N % buf_usable_frames, and the vsync thread pans to the slots in the
+    // same order. A slot stays in use by the display controller until two
+    // other frames have been panned after it
+
+    /** Information about a frame stored in a framebuffer slot. */
+    struct FrameInfo
+    {
+        // True if no update remains active after this frame
+        bool last = false;
+
+        // IDs of the updates that are displayed once this frame is sent
+        std::vector<UpdateID> finished;
+
+        // Number of frames, up to this one, that need to be ready before
+        // sending the stream so that the generator stays ahead of the
+        // vsync thread until the end of the updates that are active
+        std::size_t lead = 1;
+    };
+
+    std::array<FrameInfo, buf_usable_frames> frame_info;
+
+    // Regions of each slot that differ from the null frame, used by the
+    // generator to restore only those parts before writing a new frame
+    std::array<std::vector<Region>, buf_usable_frames> frame_dirty{};
 
-    // Update for which frames are currently being generated
-    Update generate_update;
+    // Number of frames generated so far
+    std::uint64_t frames_generated = 0;
 
-    // Buffer from which the vsync thread will read to send frames
-    // to the display
-    std::vector<Frame> vsync_buffer{};
+    // Number of frames up to the last frame of the last fully
+    // generated update
+    std::uint64_t frames_complete = 0;
 
-    // Update for which frames are currently being vsynced
-    Update vsync_update;
+    // Number of frames sent to the display controller so far
+    std::uint64_t frames_vsynced = 0;
 
-    // Locks to read from or write to the vsync buffer
-    std::atomic<bool> vsync_can_read = false;
-    std::condition_variable vsync_can_read_cv;
-    std::mutex vsync_read_lock;
+    // Number of frames whose slot can be reused
+    std::uint64_t frames_released = 0;
 
-    std::atomic<bool> vsync_can_write = true;
-    std::condition_variable vsync_can_write_cv;
-    std::mutex vsync_write_lock;
+    // Lead of the last generated frame (see `FrameInfo::lead`)
+    std::size_t stream_lead = buf_usable_frames;
 
-#ifdef ENABLE_PERF_REPORT
-    std::ostringstream perf_report;
-#endif
+    // Factor applied to the lead estimate before starting a stream on it,
+    // doubled each time a stream started on the lead runs out of frames
+    // and halved again after `lead_decay_streams` clean ones
+    // (see `can_start_vsync()`)
+    std::size_t lead_scale = 1;
+    std::size_t lead_clean_streams = 0;
+    static constexpr std::size_t lead_decay_streams = 4;
+
+    // Lock protecting the ring state, signals for newly generated frames
+    // and for newly released slots
+    std::mutex frames_lock;
+    std::condition_variable frames_ready_cv;
+    std::condition_variable slots_free_cv;
+
+    // Lock protecting the set of displayed updates and signal for newly
+    // displayed updates
+    std::mutex completion_lock;
+    std::condition_variable completion_cv;
+
+    // All updates with a lower ID have been displayed
+    UpdateID displayed_below = 0;
+
+    // Updates that have been displayed, with an ID above `displayed_below`
+    std::set<UpdateID> displayed;
+
+    // Signals that waiting for updates to be displayed must stop
+    bool stopping_completion = false;
+
+    // See `set_completion_callback()`
+    std::function<void(UpdateID)> completion_callback;
+
+    /** Mark updates as displayed and notify the waiting threads. */
+    void complete_updates(const std::vector<UpdateID>& ids);
+
+    /**
+     * Mark an update that produces no frame as displayed once the frames
+     * generated before it are sent.
+     */
+    void skip_update(const Update& update);
+
+    // Recorded events, see `set_tracing()`
+    Trace trace;
+
+    // Updates not yet reported by `get_perf_report()`
+    PerfReport perf_report;
+    std::mutex perf_report_lock;
 
     /** Thread that processes update requests and generates frames. */
     std::thread generator_thread;
     void run_generator_thread();
 
-    /** Wait for the next update to be added to the queue and process it. */
-    void process_update();
+    /** Check whether an incoming update is ready to be read. */
+    bool has_incoming_update() const;
+
+    /**
+     * Wait for an incoming update to be ready.
+     *
+     * @return False if the generator thread should stop.
+     */
+    bool wait_for_updates();
+
+    /** Move all ready incoming updates to the pending queue. */
+    void drain_updates();
+
+    /** Make the memory of a finished update available for reuse. */
+    void recycle_update(Update update);
 
     /**
-     * Remove the next update from the queue (or wait if queue is empty).
+     * Start processing pending updates that do not collide with active ones.
      *
-     * The new update is placed in `generate_update`.
+     * If no update is active, this waits for an update to be added to
+     * the queue.
      *
-     * @return True if a new update is available, false if the generator
+     * @return True if at least one update is active, false if the generator
      * thread should stop.
      */
-    bool pop_update();
+    bool pop_updates();
+
+    /**
+     * Merge an update into another one.
+     *
+     * The merged update covers the bounding box of both regions, with
+     * cells outside of both regions set to their current intensity. Its
+     * mode is left unchanged.
+     *
+     * @param cur_update Update to merge into.
+     * @param next_update Update to merge.
+     */
+    void merge_update(Update& cur_update, const Update& next_update);
+
+    /**
+     * Find a mode that can be used for two merged updates.
+     *
+     * @param first Mode of the first update.
+     * @param second Mode of the second update.
+     * @return Common mode, which is the one with the highest fidelity if
+     * the other one can be promoted to it, or nothing if the modes are
+     * incompatible.
+     */
+    std::optional<ModeID> merge_mode(ModeID first, ModeID second) const;
+
+    /**
+     * Compute the share of the bounding box of two regions covered by
+     * neither of them.
+     */
+    static float merge_waste(const Region& first, const Region& second);
+
+    /**
+     * Check whether merging two updates in a common mode costs at most as
+     * much as displaying them separately, counting the number of frames
+     * of each update times its area.
+     *
+     * @param first_mode Mode of the first update.
+     * @param first Region of the first update.
+     * @param second_mode Mode of the second update.
+     * @param second Region of the second update.
+     * @param merged_mode Mode of the merged update (see `merge_mode()`).
+     */
+    bool is_merge_cheaper(
+        ModeID first_mode,
+        const Region& first,
+        ModeID second_mode,
+        const Region& second,
+        ModeID merged_mode
+    );
+
+    /**
+     * Compute the region covered by an update after alignment.
+     *
+     * @param region Update region.
+     * @return Region aligned on a 8-pixel boundary on the X axis.
+     */
+    static Region align_region(Region region);
+
+    /** Align an update on a 8-pixel boundary on the X axis. */
+    void align_update(Update& update);
+
+    /**
+     * Shrink an update to the bounding box of the cells it changes.
+     *
+     * This is only valid if the update waveform never drives cells that
+     * keep the same intensity.
+     *
+     * @return False if the update does not change any cell.
+     */
+    bool shrink_update(Update& update);
+
+    /**
+     * Prepare an update for frame generation and add it to the active set.
+     *
+     * @param update Update to activate.
+     */
+    void activate_update(Update update);
+
+    /**
+     * Scan update to find pixel transitions equal to their predecessor.
+     *
+     * Fills the `is_consecutive` and `transition_mask` of the update.
+     */
+    void check_consecutive(ActiveUpdate& active);
+
+    /**
+     * Assign compact IDs to the set of transitions found in an update.
+     *
+     * @return Number of cells whose transition IDs can be packed into a single
+     * byte (4, 2 or 1), or 0 if the update contains too many different
+     * transitions to use lookup tables.
+     */
+    std::size_t scan_transitions(ActiveUpdate& active);
+
+    /**
+     * Restrict the frames to generate for an update to the ones that have
+     * an effect on at least one of its transitions.
+     *
+     * @return True if at least one frame remains.
+     */
+    static bool trim_frames(ActiveUpdate& active);
+
+    /** Pack the transition IDs of an update into its `transition_keys`. */
+    void pack_transitions(ActiveUpdate& active);
+
+    /**
+     * Check whether an update only contains transitions between black and
+     * white and if so, build its `binary_planes` and `transition_mask`.
+     *
+     * @return True if the update is binary.
+     */
+    bool scan_binary(ActiveUpdate& active);
+
+    /**
+     * Write the phases for a binary update into a frame using only
+     * bitwise operations on its planes.
+     *
+     * @param active Update to write.
+     * @param matrix Phase matrix for the frame to generate.
+     * @param data Pointer to the first frame byte of the update region.
+     * @param row_begin First row of the region to write.
+     * @param row_end Row following the last row of the region to write.
+     */
+    void write_frame_binary(
+        const ActiveUpdate& active,
+        const PhaseMatrix& matrix,
+        std::uint8_t* data,
+        std::size_t row_begin,
+        std::size_t row_end
+    );
+
+    /**
+     * Write the phases for an update into a frame using a lookup table built
+     * from the packed transition keys.
+     *
+     * @param active Update to write.
+     * @param matrix Phase matrix for the frame to generate.
+     * @param data Pointer to the first frame byte of the update region.
+     * @param row_begin First row of the region to write.
+     * @param row_end Row following the last row of the region to write.
+     */
+    void write_frame_lut(
+        const ActiveUpdate& active,
+        const PhaseMatrix& matrix,
+        std::uint8_t* data,
+        std::size_t row_begin,
+        std::size_t row_end
+    );
+
+    /**
+     * Write the phases for an update into a frame by looking up each
+     * cell individually.
+     *
+     * @param active Update to write.
+     * @param matrix Phase matrix for the frame to generate.
+     * @param data Pointer to the first frame byte of the update region.
+     * @param row_begin First row of the region to write.
+     * @param row_end Row following the last row of the region to write.
+     */
+    void write_frame_direct(
+        const ActiveUpdate& active,
+        const PhaseMatrix& matrix,
+        std::uint8_t* data,
+        std::size_t row_begin,
+        std::size_t row_end
+    );
+
+    /**
+     * Check whether the recorded frames of a compiled update can be used
+     * for displaying it from the current intensities, and if so, prepare
+     * it for copying them.
+     *
+     * @param active Update to prepare, aligned on a 8-pixel boundary on
+     * the X axis.
+     * @return True if the recorded frames can be used.
+     */
+    bool start_replay(ActiveUpdate& active);
+
+    /**
+     * Start recording the frames of a compiled update whose frames are
+     * about to be generated.
+     */
+    void start_recording(ActiveUpdate& active);
+
+    /** Record the current frame of a compiled update from a frame. */
+    void record_frame(ActiveUpdate& active, const std::uint8_t* frame);
 
     /**
-     * Try to merge the next update from the queue into the current update.
+     * Copy the recorded phases for the current frame of a compiled update
+     * into a frame.
      *
-     * Two updates can be merged if they bear the same update mode.
-     * This assumes that a lock on updates_lock is already held by
-     * the current thread.
+     * @param active Update to write.
+     * @param data Pointer to the first frame byte of the update region.
+     * @param row_begin First row of the region to write.
+     * @param row_end Row following the last row of the region to write.
+     */
+    void write_frame_replay(
+        const ActiveUpdate& active,
+        std::uint8_t* data,
+        std::size_t row_begin,
+        std::size_t row_end
+    );
+
+    /**
+     * Prepare the next phase frame for all active updates and retire the
+     * updates whose waveform is complete.
+     */
+    void generate_frame();
+
+    /**
+     * Write the current frame of all active updates, splitting the work
+     * across worker threads if it is large enough.
+     *
+     * @param frame Frame to write to.
+     */
+    void write_frame(std::uint8_t* frame);
+
+    /**
+     * Write one horizontal band of the current frame of all active updates.
      *
-     * @return True if an update was merged into the current update,
-     * false otherwise.
+     * Bands split the rows spanned by all active updates, so that each
+     * frame row is written by a single thread. On groups of cells shared
+     * with a later update (see `release_region()`), an update writes
+     * no-op phases which the later update then overwrites with its own,
+     * as updates are written in the order they were activated.
+     *
+     * @param frame Frame to write to.
+     * @param band Index of the band to write.
+     * @param band_count Number of bands the frame is split in.
+     */
+    void write_band(
+        std::uint8_t* frame,
+        std::size_t band,
+        std::size_t band_count
+    );
+
+    // See `set_generator_thread_count()`
+    std::size_t generator_thread_count = std::max(
+        std::thread::hardware_concurrency(), 1u
+    );
+
+    // See `set_vsync_priority()`
+    int vsync_priority = 0;
+
+    // See `set_thread_affinity()`
+    std::vector<unsigned> generator_cpus;
+    std::vector<unsigned> vsync_cpus;
+
+    // See `set_memory_locking()`
+    bool lock_memory = false;
+    bool memory_locked = false;
+
+    // See `get_missed_vsync_count()`
+    std::atomic<std::uint64_t> missed_vsyncs = 0;
+
+    // Minimum number of cells covered by the active updates in a frame
+    // for splitting its generation across workers, below which the
+    // synchronization cost is not worth it
+    static constexpr std::size_t min_split_cells = 64 * 1024;
+
+    /**
+     * Threads that write bands of frames on behalf of the generator thread.
+     * Worker N writes band N, band 0 being written by the generator thread.
      */
-    bool merge_update();
+    std::vector<std::thread> worker_threads;
+    void run_worker_thread(std::size_t band);
+
+    /** Start one worker thread per band past the first one. */
+    void start_workers();
+
+    /** Stop and join all worker threads. */
+    void stop_workers();
+
+    // Lock protecting the worker state, signals for new frames to write
+    // and for finished bands
+    std::mutex workers_lock;
+    std::condition_variable workers_start_cv;
+    std::condition_variable workers_done_cv;
+
+    // Frame being written by the workers and its number of bands
+    std::uint8_t* worker_frame = nullptr;
+    std::size_t worker_band_count = 0;
 
-    /** Align the current update on a 8-pixel boundary on the X axis. */
-    void align_update();
+    // Incremented each time workers are given a new frame to write
+    std::size_t worker_job = 0;
 
-    /** Scan update to find pixel transitions equal to their predecessor. */
-    std::vector<bool> check_consecutive();
+    // Number of workers that have not finished writing their band
+    std::size_t workers_pending = 0;
 
-    /** Prepare phase frames for the current update. */
-    void generate_frames();
+    // Signals that the workers need to stop
+    bool stopping_workers = false;
+
+    /**
+     * Wait for a framebuffer slot to be free for generating the next frame.
+     *
+     * @return Pointer to the slot, or nullptr if the generator thread should
+     * stop.
+     */
+    std::uint8_t* acquire_frame();
+
+    /** Make the last acquired frame available to the vsync thread. */
+    void publish_frame(FrameInfo info);
+
+    /**
+     * Estimate how many frames need to be ready before sending a stream so
+     * that the vsync thread does not run out of frames.
+     *
+     * @param duration Time taken to generate the last frame.
+     * @param remaining Number of frames left to generate for the active
+     * updates.
+     * @return Number of ready frames.
+     */
+    std::size_t compute_stream_lead(
+        std::chrono::steady_clock::duration duration,
+        std::size_t remaining
+    ) const;
 
     /** Store a null frame at the given buffer location. */
     void reset_frame(std::size_t frame_index);
 
-    /** Update current_intensity status with the current update. */
-    void commit_update();
+    /**
+     * Restore the null frame contents over a region of a frame.
+     *
+     * @param frame Pointer to the start of the frame.
+     * @param region Region to restore (aligned on a 8-pixel boundary
+     * on the X axis).
+     */
+    void restore_frame(std::uint8_t* frame, const Region& region);
+
+    /** Update current_intensity status with a finished update. */
+    void commit_update(const Update& update);
+
+    /**
+     * Update current_intensity status with part of an update.
+     *
+     * @param update Update to commit.
+     * @param part Part of the update region to commit.
+     */
+    void commit_region(const Update& update, const Region& part);
+
+    /**
+     * Check whether all cells of an active update within a region have
+     * finished transitioning, so that a later update can start on them.
+     *
+     * @param active Active update.
+     * @param part Part of the update region to check (aligned on a 8-pixel
+     * boundary on the X axis).
+     */
+    bool is_released(ActiveUpdate& active, const Region& part);
+
+    /**
+     * Hand over a part of an active update to a later update, committing
+     * the intensities it reached.
+     *
+     * @param active Active update.
+     * @param part Part of the update region for which `is_released()` holds.
+     */
+    void release_region(ActiveUpdate& active, const Region& part);
 
     /** Thread that sends ready frames to the display controller via vsync. */
     std::thread vsync_thread;
     void run_vsync_thread();
 
-#ifdef ENABLE_PERF_REPORT
-    /** Add perf report record for finished update. */
-    void make_perf_record();
-#endif // ENABLE_PERF_REPORT
+    /**
+     * Check whether the vsync thread can start sending frames.
+     *
+     * Sending starts once an update is fully generated, when the ring is
+     * full, or as soon as the estimated lead says that enough frames are
+     * ready for the generator to stay ahead of the vsync thread (usually
+     * right after the first frame).
+     *
+     * Starting on the lead estimate is not timing-safe: if the generator
+     * falls behind nonetheless, the controller shows the default null frame
+     * until the next frame is ready, which stretches the drive timing of
+     * all updates in flight. Each time this happens in a stream started on
+     * the lead, the estimate is scaled up (see `lead_scale`), and it decays
+     * back after streams that kept up. This assumes that a lock on
+     * frames_lock is already held by the current thread.
+     */
+    bool can_start_vsync() const;
+
+    /**
+     * Check whether the vsync thread can start sending frames without
+     * relying on the lead estimate, i.e. an update is fully generated or
+     * the ring is full. This assumes that a lock on frames_lock is already
+     * held by the current thread.
+     */
+    bool can_start_vsync_safely() const;
+
+    /**
+     * Adjust the lead scale after a stream started on the lead estimate.
+     *
+     * @param missed Whether the vsync thread ran out of frames at any
+     * point of the stream.
+     */
+    void adjust_lead_scale(bool missed);
 }; // class Display
 
+/**
+ * Update prepared for being displayed repeatedly, see
+ * `Display::compile_update()`.
+ */
+class CompiledUpdate
+{
+private:
+    friend class Display;
+
+    // Update mode
+    ModeID mode = 0;
+
+    // Coordinates of the region affected by the update, in display
+    // coordinates
+    Region region{};
+
+    // New intensities of the region
+    std::vector<Intensity> buffer;
+
+    // The following fields describe the recorded frames and are only
+    // accessed from the generator thread
+
+    // Waveform the frames were recorded with, or null if no frames were
+    // fully recorded
+    std::shared_ptr<const Waveform> waveform;
+
+    // Lowest intensity that receives the same phases in all frames of the
+    // waveform as each (from, to) transition, indexed by `(from << 5) | to`
+    std::array<Intensity, intensity_values * intensity_values>
+        equivalent_from{};
+
+    // Region covered by the recorded frames, aligned on a 8-pixel boundary
+    // on the X axis, and new intensities of that region
+    Region frame_region{};
+    std::vector<Intensity> frame_buffer;
+
+    // Equivalent intensity (see `equivalent_from`) that each cell started
+    // from when recording
+    std::vector<Intensity> from_key;
+
+    // Index of the first recorded frame in the waveform
+    std::size_t frame_begin = 0;
+
+    // Distinct contents of the recorded frames over the region, with two
+    // bytes per group of 8 cells, and their hashes
+    std::vector<std::vector<std::uint8_t>> images;
+    std::vector<std::size_t> image_hashes;
+
+    // Index of the contents of each recorded frame
+    std::vector<std::size_t> sequence;
+};
+
 } // namespace Waved
 
 #endif // WAVED_DISPLAY_HPP
@@ -0,0 +1,280 @@
+/**
+ * @file
+ * SPDX-FileCopyrightText: 2021-2022 Mattéo Delabre <git.matteo@delab.re>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "pipeline.hpp"
+#include <algorithm>
+
+// Use the NEON code paths only if the target actually supports them
+#if defined(ENABLE_NEON) && defined(__ARM_NEON)
+#define USE_NEON
+#include <arm_neon.h>
+#endif // ENABLE_NEON && __ARM_NEON
+
+namespace Waved
+{
+
+namespace
+{
+
+/** Add the transitions of a group of cells to a transition mask. */
+inline void mark_transitions(
+    TransitionMask& mask,
+    const Intensity* prev,
+    const Intensity* next,
+    std::size_t count
+)
+{
+    for (std::size_t i = 0; i < count; ++i) {
+        mask[prev[i] * 2 + (next[i] >> 4)]
+            |= std::uint32_t{3} << ((next[i] & 15) * 2);
+    }
+}
+
+} // anonymous namespace
+
+void copy_rect(
+    const Intensity* source,
+    const Region& source_region,
+    std::uint32_t source_width,
+    Intensity* dest,
+    std::uint32_t dest_top,
+    std::uint32_t dest_left,
+    std::uint32_t dest_width
+)
+{
+    source += source_region.left + source_width * source_region.top;
+    dest += dest_left + dest_width * dest_top;
+
+    for (std::uint32_t y = 0; y < source_region.height; ++y) {
+        std::copy(source, source + source_region.width, dest);
+        source += source_width;
+        dest += dest_width;
+    }
+}
+
+void merge_rects(
+    const Intensity* current,
+    std::uint32_t current_width,
+    const Region& merged_region,
+    const Region& first_region,
+    const Intensity* first,
+    const Region& second_region,
+    const Intensity* second,
+    Intensity* dest
+)
+{
+    copy_rect(
+        /* source = */ current,
+        /* source_region = */ merged_region,
+        /* source_width = */ current_width,
+        /* dest = */ dest,
+        /* dest_top = */ 0,
+        /* dest_left = */ 0,
+        /* dest_width = */ merged_region.width
+    );
+
+    copy_rect(
+        /* source = */ first,
+        /* source_region = */ Region{
+            0, 0,
+            first_region.width, first_region.height
+        },
+        /* source_width = */ first_region.width,
+        /* dest = */ dest,
+        /* dest_top = */ first_region.top - merged_region.top,
+        /* dest_left = */ first_region.left - merged_region.left,
+        /* dest_width = */ merged_region.width
+    );
+
+    copy_rect(
+        /* source = */ second,
+        /* source_region = */ Region{
+            0, 0,
+            second_region.width, second_region.height
+        },
+        /* source_width = */ second_region.width,
+        /* dest = */ dest,
+        /* dest_top = */ second_region.top - merged_region.top,
+        /* dest_left = */ second_region.left - merged_region.left,
+        /* dest_width = */ merged_region.width
+    );
+}
+
+void align_rect(
+    const Intensity* current,
+    std::uint32_t current_width,
+    Region& region,
+    std::vector<Intensity>& buffer
+)
+{
+    constexpr auto mask = cell_group - 1;
+
+    if ((region.width & mask) == 0 && (region.left & mask) == 0) {
+        return;
+    }
+
+    auto aligned_left = region.left & ~mask;
+    auto pad_left = region.left & mask;
+    auto new_width = (pad_left + region.width + mask) & ~mask;
+    auto pad_right = new_width - pad_left - region.width;
+
+    std::vector<Intensity> new_buffer(region.height * new_width);
+
+    const Intensity* prev = current
+        + region.top * current_width
+        + aligned_left;
+
+    const Intensity* old_next = buffer.data();
+    Intensity* new_next = new_buffer.data();
+
+    for (std::size_t y = 0; y < region.height; ++y) {
+        for (std::size_t x = 0; x < pad_left; ++x) {
+            *new_next++ = *prev++;
+        }
+
+        for (std::size_t x = 0; x < region.width; ++x) {
+            *new_next++ = *old_next++;
+        }
+
+        prev += region.width;
+
+        for (std::size_t x = 0; x < pad_right; ++x) {
+            *new_next++ = *prev++;
+        }
+
+        prev += current_width - new_width;
+    }
+
+    buffer = std::move(new_buffer);
+    region.left = aligned_left;
+    region.width = new_width;
+}
+
+void find_consecutive(
+    const Intensity* prev_base,
+    std::uint32_t prev_width,
+    const Intensity* next_base,
+    std::uint32_t width,
+    std::uint32_t height,
+    std::vector<bool>& result,
+    TransitionMask& mask
+)
+{
+    result.assign(height * width / cell_group, false);
+    mask.fill(0);
+
+    const Intensity* prev = prev_base;
+    const Intensity* next = next_base;
+
+    bool first = true;
+    std::size_t i = 0;
+
+#ifdef USE_NEON
+    constexpr std::uint64_t all_equal = ~std::uint64_t{0};
+    uint8x8_t last_prevs = vdup_n_u8(0);
+    uint8x8_t last_nexts = vdup_n_u8(0);
+
+    for (std::size_t y = 0; y < height; ++y) {
+        std::size_t x = 0;
+
+        // Compare two groups at a time with the group that precedes each one
+        for (; x + 2 <= width / cell_group; x += 2) {
+            uint8x16_t cur_prevs = vld1q_u8(prev);
+            uint8x16_t cur_nexts = vld1q_u8(next);
+            uint64x2_t equal = vreinterpretq_u64_u8(vandq_u8(
+                vceqq_u8(
+                    cur_prevs,
+                    vcombine_u8(last_prevs, vget_low_u8(cur_prevs))
+                ),
+                vceqq_u8(
+                    cur_nexts,
+                    vcombine_u8(last_nexts, vget_low_u8(cur_nexts))
+                )
+            ));
+
+            result[i] = !first && vgetq_lane_u64(equal, 0) == all_equal;
+            result[i + 1] = vgetq_lane_u64(equal, 1) == all_equal;
+
+            // Consecutive groups repeat the transitions of their predecessor
+            if (!result[i]) {
+                mark_transitions(mask, prev, next, cell_group);
+            }
+
+            if (!result[i + 1]) {
+                mark_transitions(
+                    mask,
+                    prev + cell_group,
+                    next + cell_group,
+                    cell_group
+                );
+            }
+
+            first = false;
+            last_prevs = vget_high_u8(cur_prevs);
+            last_nexts = vget_high_u8(cur_nexts);
+
+            prev += 2 * cell_group;
+            next += 2 * cell_group;
+            i += 2;
+        }
+
+        for (; x < width / cell_group; ++x) {
+            uint8x8_t cur_prevs = vld1_u8(prev);
+            uint8x8_t cur_nexts = vld1_u8(next);
+            uint64x1_t equal = vreinterpret_u64_u8(vand_u8(
+                vceq_u8(cur_prevs, last_prevs),
+                vceq_u8(cur_nexts, last_nexts)
+            ));
+
+            result[i] = !first && vget_lane_u64(equal, 0) == all_equal;
+
+            if (!result[i]) {
+                mark_transitions(mask, prev, next, cell_group);
+            }
+
+            first = false;
+            last_prevs = cur_prevs;
+            last_nexts = cur_nexts;
+
+            prev += cell_group;
+            next += cell_group;
+            ++i;
+        }
+
+        prev += prev_width - width;
+    }
+#else
+    std::array<Intensity, cell_group> last_prevs;
+    std::array<Intensity, cell_group> last_nexts;
+
+    for (std::size_t y = 0; y < height; ++y) {
+        for (std::size_t x = 0; x < width / cell_group; ++x) {
+            result[i] = (
+                !first
+                && std::equal(last_prevs.cbegin(), last_prevs.cend(), prev)
+                && std::equal(last_nexts.cbegin(), last_nexts.cend(), next)
+            );
+
+            // Consecutive groups repeat the transitions of their predecessor
+            if (!result[i]) {
+                mark_transitions(mask, prev, next, cell_group);
+            }
+
+            first = false;
+            std::copy(prev, prev + cell_group, last_prevs.begin());
+            std::copy(next, next + cell_group, last_nexts.begin());
+
+            prev += cell_group;
+            next += cell_group;
+            ++i;
+        }
+
+        prev += prev_width - width;
+    }
+#endif // USE_NEON
+}
+
+} // namespace Waved
@@ -0,0 +1,114 @@
+/**
+ * @file Stages of the display pipeline that only work on intensity buffers.
+ * These are internal to the library and not part of its interface, but are
+ * kept apart so that the benchmark program can measure them.
+ * SPDX-FileCopyrightText: 2021-2022 Mattéo Delabre <git.matteo@delab.re>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef WAVED_PIPELINE_HPP
+#define WAVED_PIPELINE_HPP
+
+#include "defs.hpp"
+#include <array>
+#include <cstdint>
+#include <vector>
+
+namespace Waved
+{
+
+// Number of consecutive cells whose phases share the bytes of a frame
+constexpr std::uint32_t cell_group = 8;
+
+/**
+ * Set of (prev, next) intensity pairs, laid out like the words of a
+ * `PhaseMatrix` with both bits of each present pair set.
+ */
+using TransitionMask = std::array<std::uint32_t, intensity_values * 2>;
+
+/**
+ * Copy a rectangle of intensities from one buffer to another.
+ *
+ * @param source Source buffer.
+ * @param source_region Rectangle to copy from the source buffer.
+ * @param source_width Number of intensities per source row.
+ * @param dest Destination buffer.
+ * @param dest_top Row of the destination buffer to copy to.
+ * @param dest_left Column of the destination buffer to copy to.
+ * @param dest_width Number of intensities per destination row.
+ */
+void copy_rect(
+    const Intensity* source,
+    const Region& source_region,
+    std::uint32_t source_width,
+    Intensity* dest,
+    std::uint32_t dest_top,
+    std::uint32_t dest_left,
+    std::uint32_t dest_width
+);
+
+/**
+ * Overlay two updates onto the current intensities of a region covering
+ * both, the second one taking precedence where they overlap.
+ *
+ * @param current Current intensities of the whole display.
+ * @param current_width Number of intensities per row of `current`.
+ * @param merged_region Region covering both updates.
+ * @param first_region Region of the first update.
+ * @param first Intensities of the first update.
+ * @param second_region Region of the second update.
+ * @param second Intensities of the second update.
+ * @param dest Buffer receiving the intensities of `merged_region`.
+ */
+void merge_rects(
+    const Intensity* current,
+    std::uint32_t current_width,
+    const Region& merged_region,
+    const Region& first_region,
+    const Intensity* first,
+    const Region& second_region,
+    const Intensity* second,
+    Intensity* dest
+);
+
+/**
+ * Widen an update on both sides to whole groups of cells, padding it with
+ * the current intensities.
+ *
+ * @param current Current intensities of the whole display.
+ * @param current_width Number of intensities per row of `current`.
+ * @param region Region of the update, aligned in place.
+ * @param buffer Intensities of the update, replaced in place.
+ */
+void align_rect(
+    const Intensity* current,
+    std::uint32_t current_width,
+    Region& region,
+    std::vector<Intensity>& buffer
+);
+
+/**
+ * Find the groups of cells that go through the same transitions as the
+ * group preceding them, and collect the transitions of the others.
+ *
+ * @param prev Current intensities of the top left cell of the update.
+ * @param prev_width Number of intensities per row of `prev`.
+ * @param next Intensities of the update.
+ * @param width Width of the update (multiple of `cell_group`).
+ * @param height Height of the update.
+ * @param result Receives whether each group repeats the previous one.
+ * @param mask Receives the transitions of the groups that do not.
+ */
+void find_consecutive(
+    const Intensity* prev,
+    std::uint32_t prev_width,
+    const Intensity* next,
+    std::uint32_t width,
+    std::uint32_t height,
+    std::vector<bool>& result,
+    TransitionMask& mask
+);
+
+} // namespace Waved
+
+#endif // WAVED_PIPELINE_HPP
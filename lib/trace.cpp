@@ -0,0 +1,319 @@
+/**
+ * @file
+ * SPDX-FileCopyrightText: 2021-2022 Mattéo Delabre <git.matteo@delab.re>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "trace.hpp"
+#include <algorithm>
+#include <chrono>
+
+namespace chrono = std::chrono;
+
+namespace Waved
+{
+
+auto TraceEvent::now() -> std::uint64_t
+{
+    return chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+void Trace::set_enabled(bool enabled)
+{
+    std::lock_guard<std::mutex> lock(this->lock);
+
+    if (enabled && !this->slots) {
+        this->slots = std::make_unique<Slot[]>(capacity);
+    }
+
+    // Pairs with the load in `record()` so that recorders see the slots
+    this->enabled.store(enabled, std::memory_order_release);
+}
+
+auto Trace::is_enabled() const -> bool
+{
+    return this->enabled.load(std::memory_order_relaxed);
+}
+
+void Trace::record(const TraceEvent& event)
+{
+    if (!this->enabled.load(std::memory_order_acquire)) {
+        return;
+    }
+
+    const auto position = this->head.fetch_add(1, std::memory_order_relaxed);
+    auto& slot = this->slots[position % capacity];
+
+    // Mark the slot as being written so that readers do not use a mix of
+    // old and new words, then publish the event
+    slot.sequence.store(position * 2 + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.words[0].store(event.time, std::memory_order_relaxed);
+    slot.words[1].store(
+        event.frame | std::uint64_t{event.id} << 32,
+        std::memory_order_relaxed
+    );
+    slot.words[2].store(
+        event.value
+            | std::uint64_t{event.width} << 32
+            | std::uint64_t{event.height} << 48,
+        std::memory_order_relaxed
+    );
+    slot.words[3].store(
+        static_cast<std::uint64_t>(event.type)
+            | std::uint64_t{event.mode} << 8,
+        std::memory_order_relaxed
+    );
+
+    slot.sequence.store(position * 2 + 2, std::memory_order_release);
+}
+
+auto Trace::pull(std::size_t* dropped) -> std::vector<TraceEvent>
+{
+    std::lock_guard<std::mutex> lock(this->lock);
+    std::vector<TraceEvent> result;
+    std::size_t lost = 0;
+
+    if (this->slots) {
+        const auto head = this->head.load(std::memory_order_acquire);
+
+        if (head - this->tail > capacity) {
+            lost += head - capacity - this->tail;
+            this->tail = head - capacity;
+        }
+
+        result.reserve(head - this->tail);
+
+        for (; this->tail < head; ++this->tail) {
+            const auto& slot = this->slots[this->tail % capacity];
+            const auto expected = this->tail * 2 + 2;
+            const auto sequence = slot.sequence.load(
+                std::memory_order_acquire
+            );
+
+            if (sequence < expected) {
+                // Still being written, retry on the next call
+                break;
+            }
+
+            std::array<std::uint64_t, 4> words;
+
+            for (std::size_t i = 0; i < words.size(); ++i) {
+                words[i] = slot.words[i].load(std::memory_order_relaxed);
+            }
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            if (
+                sequence != expected
+                || slot.sequence.load(std::memory_order_relaxed) != expected
+            ) {
+                // Overwritten by a later event
+                ++lost;
+                continue;
+            }
+
+            TraceEvent event;
+            event.time = words[0];
+            event.frame = static_cast<std::uint32_t>(words[1]);
+            event.id = static_cast<std::uint32_t>(words[1] >> 32);
+            event.value = static_cast<std::uint32_t>(words[2]);
+            event.width = static_cast<std::uint16_t>(words[2] >> 32);
+            event.height = static_cast<std::uint16_t>(words[2] >> 48);
+            event.type = static_cast<TraceEventType>(words[3] & 0xFF);
+            event.mode = static_cast<std::uint8_t>(words[3] >> 8);
+            result.push_back(event);
+        }
+    }
+
+    if (dropped != nullptr) {
+        *dropped = lost;
+    }
+
+    return result;
+}
+
+auto PerfReport::get_header() -> const char*
+{
+    return "id,mode,width,height,transform_duration,queue_time,dequeue_time,"
+        "generate_times,vsync_times,first_vsync_latency\n";
+}
+
+auto PerfReport::add(const std::vector<TraceEvent>& events) -> std::string
+{
+    std::string out;
+
+    for (const auto& event : events) {
+        switch (event.type) {
+        case TraceEventType::Queue: {
+            if (this->updates.size() >= max_updates) {
+                this->updates.erase(this->updates.begin());
+            }
+
+            auto& update = this->updates[event.id];
+            update.ids.assign(1, event.id);
+            update.mode = event.mode;
+            update.width = event.width;
+            update.height = event.height;
+            update.transform_duration = event.value;
+            update.queue_time = event.time;
+            update.dequeue_time = event.time;
+            break;
+        }
+
+        case TraceEventType::Dequeue: {
+            auto it = this->updates.find(event.id);
+
+            if (it != this->updates.end()) {
+                it->second.dequeue_time = event.time;
+            }
+            break;
+        }
+
+        case TraceEventType::Merge: {
+            auto merged = this->updates.find(event.id);
+            auto into = this->updates.find(event.value);
+
+            if (merged != this->updates.end()) {
+                if (into != this->updates.end()) {
+                    auto& ids = into->second.ids;
+                    ids.insert(
+                        ids.end(),
+                        merged->second.ids.cbegin(),
+                        merged->second.ids.cend()
+                    );
+                    into->second.transform_duration
+                        += merged->second.transform_duration;
+                }
+
+                this->updates.erase(merged);
+            }
+            break;
+        }
+
+        case TraceEventType::Activate: {
+            auto it = this->updates.find(event.id);
+
+            if (it != this->updates.end()) {
+                auto& update = it->second;
+                update.mode = event.mode;
+                update.width = event.width;
+                update.height = event.height;
+                update.activate_time = event.time;
+                update.first_frame = event.frame;
+                update.frame_count = event.value;
+                update.activated = true;
+            }
+            break;
+        }
+
+        case TraceEventType::Generate:
+            this->frames[event.frame].generate_time = event.time;
+            this->next_frame = event.frame + 1;
+            break;
+
+        case TraceEventType::Vsync: {
+            auto it = this->frames.find(event.frame);
+
+            if (it != this->frames.end()) {
+                it->second.vsync_start = event.time - event.value;
+                it->second.vsync_end = event.time;
+            }
+            break;
+        }
+
+        case TraceEventType::Complete: {
+            auto it = this->updates.find(event.id);
+
+            if (it != this->updates.end()) {
+                // Updates that produced no frames are not reported
+                if (it->second.activated) {
+                    this->write_row(out, it->second);
+                }
+
+                this->updates.erase(it);
+            }
+            break;
+        }
+
+        default:
+            break;
+        }
+    }
+
+    // Forget frames that do not belong to any update left to report
+    std::uint32_t keep_from = this->next_frame;
+
+    for (const auto& [id, update] : this->updates) {
+        if (update.activated) {
+            keep_from = std::min(keep_from, update.first_frame);
+        }
+    }
+
+    this->frames.erase(
+        this->frames.begin(),
+        this->frames.lower_bound(keep_from)
+    );
+    return out;
+}
+
+void PerfReport::write_row(std::string& out, const Update& update) const
+{
+    auto append_list = [&out](const std::vector<std::uint64_t>& values) {
+        for (std::size_t i = 0; i < values.size(); ++i) {
+            if (i > 0) {
+                out += ':';
+            }
+
+            out += std::to_string(values[i]);
+        }
+    };
+
+    std::vector<std::uint64_t> ids(update.ids.cbegin(), update.ids.cend());
+    std::vector<std::uint64_t> generate_times{update.activate_time};
+    std::vector<std::uint64_t> vsync_times;
+
+    for (std::uint32_t i = 0; i < update.frame_count; ++i) {
+        auto it = this->frames.find(update.first_frame + i);
+
+        if (it == this->frames.end()) {
+            // Events for this update were lost
+            return;
+        }
+
+        const auto& frame = it->second;
+        generate_times.push_back(frame.generate_time);
+
+        if (frame.vsync_end != 0) {
+            if (vsync_times.empty()) {
+                vsync_times.push_back(frame.vsync_start);
+            }
+
+            vsync_times.push_back(frame.vsync_end);
+        }
+    }
+
+    append_list(ids);
+    out += ',' + std::to_string(update.mode);
+    out += ',' + std::to_string(update.width);
+    out += ',' + std::to_string(update.height);
+    out += ',' + std::to_string(update.transform_duration);
+    out += ',' + std::to_string(update.queue_time);
+    out += ',' + std::to_string(update.dequeue_time);
+    out += ',';
+    append_list(generate_times);
+    out += ',';
+    append_list(vsync_times);
+    out += ',';
+
+    if (vsync_times.size() >= 2) {
+        out += std::to_string(vsync_times[1] - update.dequeue_time);
+    }
+
+    out += '\n';
+}
+
+} // namespace Waved
@@ -0,0 +1,229 @@
+/**
+ * @file Recording of timed events from the display pipeline.
+ * SPDX-FileCopyrightText: 2021-2022 Mattéo Delabre <git.matteo@delab.re>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef WAVED_TRACE_HPP
+#define WAVED_TRACE_HPP
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Waved
+{
+
+/** Kinds of events recorded in a trace. */
+enum class TraceEventType : std::uint8_t
+{
+    // An update was added to the queue (id, mode, width, height). The value
+    // is the time spent converting its pixels, in microseconds
+    Queue,
+
+    // An update was taken out of the queue (id)
+    Dequeue,
+
+    // An update (id) was merged into another one, whose ID (low 32 bits)
+    // is the value
+    Merge,
+
+    // Frames started being generated for an update (id, mode, width,
+    // height), starting from a given frame. The value is the number of
+    // frames to generate for it
+    Activate,
+
+    // A frame was generated
+    Generate,
+
+    // A frame was sent to the controller. The value is the time spent
+    // sending it, in microseconds
+    Vsync,
+
+    // An update is displayed (id)
+    Complete,
+
+    // The controller was switched on or off
+    PowerOn,
+    PowerOff,
+
+    // The panel temperature changed to a new range. The value is the
+    // temperature in degrees Celsius, as a signed integer
+    Temperature,
+};
+
+/** Event recorded in a trace. */
+struct TraceEvent
+{
+    // Time of the event, in microseconds from the steady clock epoch
+    std::uint64_t time = 0;
+
+    // Frame number, for frame-related events
+    std::uint32_t frame = 0;
+
+    // Low 32 bits of the update ID, for update-related events
+    std::uint32_t id = 0;
+
+    // Event-specific value
+    std::uint32_t value = 0;
+
+    // Size of the update region, for update-related events
+    std::uint16_t width = 0;
+    std::uint16_t height = 0;
+
+    TraceEventType type = TraceEventType::Queue;
+
+    // Update mode, for update-related events
+    std::uint8_t mode = 0;
+
+    /** Get the current time in the unit used for events. */
+    static std::uint64_t now();
+};
+
+/**
+ * Fixed-size ring of trace events.
+ *
+ * Events can be recorded from any thread without locking or allocating.
+ * When the ring is full, the oldest events are overwritten. Recording is
+ * disabled by default, in which case `record()` returns immediately.
+ */
+class Trace
+{
+public:
+    // Number of events kept in the ring
+    static constexpr std::size_t capacity = 1 << 15;
+
+    /**
+     * Enable or disable recording events.
+     *
+     * Memory for the ring is allocated the first time recording is enabled.
+     */
+    void set_enabled(bool enabled);
+    bool is_enabled() const;
+
+    /** Record an event, if recording is enabled. */
+    void record(const TraceEvent& event);
+
+    /**
+     * Retrieve the events recorded since the last call, in the order they
+     * were recorded.
+     *
+     * @param dropped If not null, receives the number of events that were
+     * overwritten before they could be retrieved.
+     */
+    std::vector<TraceEvent> pull(std::size_t* dropped = nullptr);
+
+private:
+    /** Event storage, packed into words that can be read concurrently. */
+    struct Slot
+    {
+        // Twice the event position plus one while being written, twice
+        // the event position plus two once written
+        std::atomic<std::uint64_t> sequence{0};
+
+        std::array<std::atomic<std::uint64_t>, 4> words{};
+    };
+
+    // Serializes enabling and retrieving events
+    std::mutex lock;
+
+    std::atomic<bool> enabled = false;
+    std::unique_ptr<Slot[]> slots;
+
+    // Position of the next event to record
+    std::atomic<std::uint64_t> head = 0;
+
+    // Position of the next event to retrieve
+    std::uint64_t tail = 0;
+};
+
+/**
+ * Builder for the performance report read by the scripts in `scripts/`.
+ *
+ * The report is a CSV document with one row per displayed update (or batch
+ * of updates merged together), with the following information:
+ *
+ * id - Unique IDs of updates in this batch
+ * mode - Update mode used
+ * width -  Width of the update rectangle
+ * height - Height of the update rectangle
+ * transform_duration - Time spent converting the update pixels to the
+ *     display coordinates in `push_update()`, in microseconds
+ * queue_time - Timestamp when the update was queued
+ * dequeue_time - Timestamp when the update started being processed
+ * generate_times - Timestamp when the update was prepared for generation,
+ *     followed by the timestamps when each of its frames was generated
+ * vsync_times - Timestamp when its first frame started being sent,
+ *     followed by the timestamps when each of its frames was sent
+ * first_vsync_latency - Time between the dequeue time and the end of
+ *     the first frame vsync, in microseconds
+ *
+ * Fields that contain a variable number of values (id, generate_times,
+ * and vsync_times) are colon-separated. Timestamps are in microseconds.
+ */
+class PerfReport
+{
+public:
+    /** Get the header row of the report. */
+    static const char* get_header();
+
+    /**
+     * Process trace events and produce the rows for the updates
+     * that they show as displayed.
+     *
+     * Events can be given in several batches. Updates whose events
+     * were partly lost are left out of the report.
+     */
+    std::string add(const std::vector<TraceEvent>& events);
+
+private:
+    /** Information about an update not yet displayed. */
+    struct Update
+    {
+        std::vector<std::uint32_t> ids;
+        std::uint8_t mode = 0;
+        std::uint16_t width = 0;
+        std::uint16_t height = 0;
+        std::uint64_t transform_duration = 0;
+        std::uint64_t queue_time = 0;
+        std::uint64_t dequeue_time = 0;
+        std::uint64_t activate_time = 0;
+        std::uint32_t first_frame = 0;
+        std::uint32_t frame_count = 0;
+        bool activated = false;
+    };
+
+    /** Timestamps for a frame. */
+    struct Frame
+    {
+        std::uint64_t generate_time = 0;
+        std::uint64_t vsync_start = 0;
+        std::uint64_t vsync_end = 0;
+    };
+
+    // Maximum number of updates tracked at a time, past which the
+    // oldest ones are given up on
+    static constexpr std::size_t max_updates = 1024;
+
+    // Updates that were queued and not yet displayed, by ID
+    std::map<std::uint32_t, Update> updates;
+
+    // Frames that could belong to updates not yet displayed, by number
+    std::map<std::uint32_t, Frame> frames;
+
+    // Number following the last generated frame
+    std::uint32_t next_frame = 0;
+
+    /** Write the report row for a displayed update. */
+    void write_row(std::string& out, const Update& update) const;
+};
+
+} // namespace Waved
+
+#endif // WAVED_TRACE_HPP
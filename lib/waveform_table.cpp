@@ -6,23 +6,104 @@
 
 #include "waveform_table.hpp"
 #include "checksum.tpp"
+#include "file_descriptor.hpp"
 #include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fstream>
 #include <filesystem>
+#include <functional>
+#include <list>
+#include <mutex>
 #include <sstream>
 #include <set>
+#include <unordered_map>
 #include <endian.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 namespace fs = std::filesystem;
 
 namespace Waved
 {
 
+namespace
+{
+
+// Default number of decoded waveforms kept in memory
+constexpr std::size_t default_decoded_capacity = 16;
+
+/** Set of distinct phase matrices shared by the waveforms of a table. */
+class MatrixPool
+{
+public:
+    /**
+     * Get the shared copy of a matrix, adding it to the pool if needed.
+     *
+     * @param matrix Matrix to look for.
+     * @return Pooled matrix, valid as long as the pool exists.
+     */
+    auto intern(const PhaseMatrix& matrix) -> const PhaseMatrix*
+    {
+        std::size_t hash = 2166136261u;
+
+        for (auto word : matrix.words) {
+            hash = (hash ^ word) * 16777619u;
+        }
+
+        auto [begin, end] = this->index.equal_range(hash);
+
+        for (auto it = begin; it != end; ++it) {
+            if (*it->second == matrix) {
+                return it->second;
+            }
+        }
+
+        const PhaseMatrix* result = &this->matrices.emplace_back(matrix);
+        this->index.emplace(hash, result);
+        return result;
+    }
+
+private:
+    // Distinct matrices (a deque is used so that existing matrices
+    // never move when adding new ones)
+    std::deque<PhaseMatrix> matrices;
+
+    // Matrices indexed by their hash
+    std::unordered_multimap<std::size_t, const PhaseMatrix*> index;
+};
+
+} // anonymous namespace
+
+struct WaveformTable::Storage
+{
+    // Decode the matrices of the waveform with the given index from the
+    // underlying data
+    std::function<std::vector<PhaseMatrix>(std::size_t)> decode;
+
+    // Protects the pool, the list of decoded waveforms and its capacity
+    std::mutex lock;
+
+    // Matrices of all decoded waveforms. Matrices are never removed from
+    // the pool, which is bounded by the number of distinct matrices in the
+    // underlying data
+    std::shared_ptr<MatrixPool> pool = std::make_shared<MatrixPool>();
+
+    // Maximum number of decoded waveforms to keep
+    std::size_t capacity = default_decoded_capacity;
+
+    // Decoded waveforms, from most to least recently used
+    std::list<std::pair<std::size_t, std::shared_ptr<const Waveform>>> decoded;
+};
+
 WaveformTable::WaveformTable()
 {}
 
 auto WaveformTable::lookup(ModeID mode, int temperature) const
--> const Waveform&
+-> std::shared_ptr<const Waveform>
 {
     if (mode < 0 || mode >= this->mode_count) {
         std::ostringstream message;
@@ -66,7 +147,57 @@ auto WaveformTable::lookup(ModeID mode, int temperature) const
     }
 
     std::size_t range = it - this->temperatures.cbegin() - 1;
-    return this->waveforms[waveform_lookup[mode][range]];
+    return this->get_waveform(this->waveform_lookup[mode][range]);
+}
+
+void WaveformTable::set_decoded_capacity(std::size_t capacity)
+{
+    std::lock_guard<std::mutex> lock(this->storage->lock);
+    auto& decoded = this->storage->decoded;
+    this->storage->capacity = std::max(capacity, std::size_t{1});
+
+    while (decoded.size() > this->storage->capacity) {
+        decoded.pop_back();
+    }
+}
+
+auto WaveformTable::get_waveform(std::size_t index) const
+-> std::shared_ptr<const Waveform>
+{
+    std::lock_guard<std::mutex> lock(this->storage->lock);
+    auto& decoded = this->storage->decoded;
+
+    auto it = std::find_if(
+        decoded.begin(),
+        decoded.end(),
+        [index](const auto& entry) {
+            return entry.first == index;
+        }
+    );
+
+    if (it != decoded.end()) {
+        decoded.splice(decoded.begin(), decoded, it);
+        return it->second;
+    }
+
+    auto matrices = this->storage->decode(index);
+    std::vector<const PhaseMatrix*> frames;
+    frames.reserve(matrices.size());
+
+    for (const auto& matrix : matrices) {
+        frames.push_back(this->storage->pool->intern(matrix));
+    }
+
+    auto waveform = std::make_shared<const Waveform>(
+        std::move(frames), this->storage->pool
+    );
+    decoded.emplace_front(index, waveform);
+
+    while (decoded.size() > this->storage->capacity) {
+        decoded.pop_back();
+    }
+
+    return waveform;
 }
 
 auto WaveformTable::get_frame_rate() const -> std::uint8_t
@@ -119,7 +250,7 @@ auto classify_mode_kind(const Waveform& waveform) -> ModeKind
     for (const auto& matrix : waveform) {
         for (Intensity from = 0; from < intensity_values; ++from) {
             for (Intensity to = 0; to < intensity_values; ++to) {
-                if (matrix[0][0] != matrix[from][to]) {
+                if (matrix.get(0, 0) != matrix.get(from, to)) {
                     is_init = false;
                     break;
                 }
@@ -148,7 +279,7 @@ auto classify_mode_kind(const Waveform& waveform) -> ModeKind
                 std::cbegin(waveform),
                 std::cend(waveform),
                 [from, to](const auto& matrix) {
-                    return matrix[from][to] == Phase::Noop;
+                    return matrix.get(from, to) == Phase::Noop;
                 }
             );
         }
@@ -217,7 +348,9 @@ void WaveformTable::populate_mode_kind_mappings()
     constexpr auto sample_temperature = 21;
 
     for (ModeID mode = 0; mode < this->mode_count; ++mode) {
-        auto kind = classify_mode_kind(this->lookup(mode, sample_temperature));
+        auto kind = classify_mode_kind(
+            *this->lookup(mode, sample_temperature)
+        );
 
         if (kind == ModeKind::UNKNOWN) {
             std::cerr << "[warn] Could not detect mode kind for mode #"
@@ -251,6 +384,90 @@ namespace
  */
 using Buffer = std::vector<char>;
 
+/** Read-only memory mapping of a whole file. */
+class MappedFile
+{
+public:
+    /**
+     * Map a file to memory.
+     *
+     * @param path Path to the file to map.
+     * @throws std::system_error If the file cannot be opened or mapped.
+     */
+    MappedFile(const char* path)
+    {
+        FileDescriptor fd{path, O_RDONLY};
+        struct stat info;
+
+        if (fstat(fd, &info) == -1) {
+            throw std::system_error(
+                errno, std::generic_category(), "Get file size"
+            );
+        }
+
+        this->length = info.st_size;
+
+        if (this->length > 0) {
+            void* result = mmap(
+                nullptr, this->length, PROT_READ, MAP_PRIVATE, fd, 0
+            );
+
+            if (result == MAP_FAILED) {
+                throw std::system_error(
+                    errno, std::generic_category(), "Map file to memory"
+                );
+            }
+
+            this->address = static_cast<const char*>(result);
+        }
+    }
+
+    MappedFile(const MappedFile& other) = delete;
+    MappedFile& operator=(const MappedFile& other) = delete;
+
+    ~MappedFile()
+    {
+        if (this->address != nullptr) {
+            munmap(const_cast<char*>(this->address), this->length);
+        }
+    }
+
+    const char* data() const
+    {
+        return this->address;
+    }
+
+    std::size_t size() const
+    {
+        return this->length;
+    }
+
+private:
+    const char* address = nullptr;
+    std::size_t length = 0;
+};
+
+/**
+ * Map a file to memory for parsing it in place.
+ *
+ * @return Mapped file, or nothing if the file cannot be mapped (for example,
+ * if it is a pipe or a character device) or is empty.
+ */
+auto map_file(const char* path) -> std::shared_ptr<const MappedFile>
+{
+    try {
+        auto file = std::make_shared<const MappedFile>(path);
+
+        if (file->size() > 0) {
+            return file;
+        }
+    } catch (const std::system_error& err) {
+        // Let the caller fall back to reading the file as a stream
+    }
+
+    return {};
+}
+
 struct __attribute__((packed)) wbf_header {
     std::uint32_t checksum; // CRC32 checksum
     std::uint32_t filesize; // Total file length
@@ -302,18 +519,19 @@ constexpr auto expected_luts = 4;
 constexpr auto expected_advanced_wfm_flags = 3;
 
 /** Parse the header of a WBF file and check its integrity. */
-auto parse_header(const Buffer& buffer) -> wbf_header
+auto parse_header(const char* data, std::size_t size) -> wbf_header
 {
-    if (buffer.size() < sizeof(wbf_header)) {
+    if (size < sizeof(wbf_header)) {
         std::ostringstream message;
         message << "Too short to be a WBF file: file is "
-            << buffer.size() << " bytes long while the minimum header size is "
+            << size << " bytes long while the minimum header size is "
             << sizeof(wbf_header) << " bytes";
         throw std::runtime_error(message.str());
     }
 
-    auto header = reinterpret_cast<const wbf_header&>(*buffer.data());
-    const auto begin = buffer.cbegin();
+    wbf_header header;
+    std::memcpy(&header, data, sizeof(header));
+    const char* begin = data;
 
     // Fix endianness if needed
     header.checksum = le32toh(header.checksum);
@@ -419,7 +637,7 @@ auto parse_header(const Buffer& buffer) -> wbf_header
 
 /** Parse the set of temperature ranges from a WBF file. */
 auto parse_temperatures(
-    const wbf_header& header, Buffer::const_iterator& begin
+    const wbf_header& header, const char*& begin
 ) -> std::vector<Temperature>
 {
     std::vector<Temperature> result;
@@ -448,7 +666,7 @@ auto parse_temperatures(
 }
 
 /** Read a pointer field to a WBF file section. */
-auto parse_pointer(Buffer::const_iterator& begin) -> std::uint32_t
+auto parse_pointer(const char*& begin) -> std::uint32_t
 {
     std::uint8_t byte1 = *begin;
     ++begin;
@@ -476,8 +694,8 @@ auto parse_pointer(Buffer::const_iterator& begin) -> std::uint32_t
 /** Computes the ordered list of waveform block addresses in a WBF file. */
 auto find_waveform_blocks(
     const wbf_header& header,
-    Buffer::const_iterator file_begin,
-    Buffer::const_iterator table_begin
+    const char* file_begin,
+    const char* table_begin
 ) -> std::vector<std::uint32_t>
 {
     std::size_t mode_count = header.mode_count + 1;
@@ -496,14 +714,14 @@ auto find_waveform_blocks(
     return {result.begin(), result.end()};
 }
 
-/** Parse a waveform block in a WBF file. */
-auto parse_waveform(Buffer::const_iterator begin, Buffer::const_iterator end)
--> Waveform
+/** Parse the matrices of a waveform block in a WBF file. */
+auto parse_waveform(const char* begin, const char* end)
+-> std::vector<PhaseMatrix>
 {
     end -= 2;
 
     PhaseMatrix matrix;
-    Waveform result;
+    std::vector<PhaseMatrix> result;
 
     std::uint8_t i = 0;
     std::uint8_t j = 0;
@@ -537,10 +755,10 @@ auto parse_waveform(Buffer::const_iterator begin, Buffer::const_iterator end)
         }
 
         for (int n = 0; n < repeat; ++n) {
-            matrix[j++][i] = p1;
-            matrix[j++][i] = p2;
-            matrix[j++][i] = p3;
-            matrix[j++][i] = p4;
+            matrix.set(j++, i, p1);
+            matrix.set(j++, i, p2);
+            matrix.set(j++, i, p3);
+            matrix.set(j++, i, p4);
 
             if (j == intensity_values) {
                 j = 0;
@@ -558,25 +776,16 @@ auto parse_waveform(Buffer::const_iterator begin, Buffer::const_iterator end)
 }
 
 /**
- * Parse all waveform blocks of a WBF file and associate them to their
- * mode and temperature indices.
+ * Associate each mode and temperature index of a WBF file to the index of
+ * its waveform block.
  */
-auto parse_waveforms(
+auto parse_lookup(
     const wbf_header& header,
     const std::vector<std::uint32_t>& blocks,
-    Buffer::const_iterator file_begin,
-    Buffer::const_iterator table_begin
-) -> std::pair<std::vector<Waveform>, WaveformTable::Lookup>
+    const char* file_begin,
+    const char* table_begin
+) -> WaveformTable::Lookup
 {
-    std::vector<Waveform> waveforms;
-
-    for (auto it = blocks.cbegin(); std::next(it) != blocks.cend(); ++it) {
-        waveforms.emplace_back(parse_waveform(
-            file_begin + *it,
-            file_begin + *(it + 1)
-        ));
-    }
-
     std::size_t mode_count = header.mode_count + 1;
     std::size_t temp_count = header.temp_range_count + 1;
     WaveformTable::Lookup waveform_lookup;
@@ -598,33 +807,31 @@ auto parse_waveforms(
         waveform_lookup.emplace_back(std::move(temp_lookup));
     }
 
-    return {waveforms, waveform_lookup};
+    return waveform_lookup;
 }
 
 } // anonymous namespace
 
-auto WaveformTable::from_wbf(std::istream& file) -> WaveformTable
+auto WaveformTable::parse_wbf(
+    std::shared_ptr<const void> owner,
+    const char* data,
+    std::size_t size
+) -> WaveformTable
 {
     WaveformTable result;
 
-    // Read the entire file in memory
-    std::ostringstream buffer_read;
-    buffer_read << file.rdbuf();
-    const std::string& buffer_str = buffer_read.str();
-    Buffer buffer(buffer_str.cbegin(), buffer_str.cend());
-
     // Parse WBF header
-    wbf_header header = parse_header(buffer);
-    auto it = buffer.cbegin() + sizeof(header);
+    wbf_header header = parse_header(data, size);
+    const char* it = data + sizeof(header);
 
     result.frame_rate = header.frame_rate == 0 ? 85 : header.frame_rate;
     result.mode_count = header.mode_count + 1;
 
     // Check expected size
-    if (header.filesize != buffer.size()) {
+    if (header.filesize != size) {
         std::ostringstream message;
         message << "Invalid filesize in WBF header: specified "
-            << header.filesize << " bytes, actual " << buffer.size()
+            << header.filesize << " bytes, actual " << size
             << " bytes";
         throw std::runtime_error(message.str());
     }
@@ -633,7 +840,7 @@ auto WaveformTable::from_wbf(std::istream& file) -> WaveformTable
     std::uint8_t zeroes[] = {0, 0, 0, 0};
     std::uint32_t crc_verif = 0;
     crc_verif = crc32_checksum(crc_verif, zeroes, zeroes + 4);
-    crc_verif = crc32_checksum(crc_verif, buffer.cbegin() + 4, buffer.cend());
+    crc_verif = crc32_checksum(crc_verif, data + 4, data + size);
 
     if (header.checksum != crc_verif) {
         std::ostringstream message;
@@ -650,19 +857,55 @@ auto WaveformTable::from_wbf(std::istream& file) -> WaveformTable
     std::uint8_t len = *it;
     it += len + 2;
 
-    // Parse waveforms
-    auto blocks = find_waveform_blocks(header, buffer.cbegin(), it);
-    blocks.push_back(buffer.size());
-    auto waveforms = parse_waveforms(header, blocks, buffer.cbegin(), it);
+    // Index waveform blocks, which are only decoded when first used
+    auto blocks = find_waveform_blocks(header, data, it);
+    blocks.push_back(size);
+    result.waveform_lookup = parse_lookup(header, blocks, data, it);
+    result.waveform_count = blocks.size() - 1;
+
+    result.storage = std::make_shared<Storage>();
+    result.storage->decode = [
+        owner = std::move(owner), data, blocks = std::move(blocks)
+    ] (std::size_t index) {
+        return parse_waveform(data + blocks[index], data + blocks[index + 1]);
+    };
 
-    result.waveforms = std::move(waveforms.first);
-    result.waveform_lookup = std::move(waveforms.second);
     result.populate_mode_kind_mappings();
     return result;
 }
 
+auto WaveformTable::from_wbf(std::istream& file) -> WaveformTable
+{
+    // Read the entire file in memory
+    constexpr std::size_t chunk_size = 1 << 16;
+    auto buffer = std::make_shared<Buffer>();
+
+    while (file) {
+        const auto size = buffer->size();
+        buffer->resize(size + chunk_size);
+        file.read(buffer->data() + size, chunk_size);
+        buffer->resize(size + file.gcount());
+    }
+
+    if (file.bad()) {
+        throw std::system_error(
+            errno, std::generic_category(), "Read file"
+        );
+    }
+
+    const char* data = buffer->data();
+    const auto size = buffer->size();
+    return WaveformTable::parse_wbf(std::move(buffer), data, size);
+}
+
 auto WaveformTable::from_wbf(const char* path) -> WaveformTable
 {
+    if (auto file = map_file(path)) {
+        const char* data = file->data();
+        const auto size = file->size();
+        return WaveformTable::parse_wbf(std::move(file), data, size);
+    }
+
     std::ifstream file{path, std::ios::binary};
 
     if (!file) {
@@ -674,6 +917,413 @@ auto WaveformTable::from_wbf(const char* path) -> WaveformTable
     return WaveformTable::from_wbf(file);
 }
 
+auto WaveformTable::from_wbf(const char* path, const char* cache_path)
+-> WaveformTable
+{
+    auto file = map_file(path);
+
+    if (!file || file->size() < sizeof(wbf_header)) {
+        // Let the full parser report the error
+        return WaveformTable::from_wbf(path);
+    }
+
+    // Identify the WBF file from its header without reading the rest
+    auto header = parse_header(file->data(), file->size());
+    Source source{header.serial, header.checksum, header.filesize};
+
+    if (auto cached = WaveformTable::from_cache(cache_path, source)) {
+        return std::move(*cached);
+    }
+
+    const char* data = file->data();
+    const auto size = file->size();
+    auto result = WaveformTable::parse_wbf(std::move(file), data, size);
+
+    try {
+        result.write_cache(cache_path, source);
+    } catch (const std::system_error& err) {
+        std::cerr << "[warn] Cannot write waveform cache: "
+            << err.what() << '\n';
+    }
+
+    return result;
+}
+
+namespace
+{
+
+/**
+ * Decoded waveform cache.
+ *
+ * The cache file contains the decoded tables of a WBF file in the native
+ * byte order, laid out so that it can be mapped and used with little
+ * processing. It starts with a `cache_header`, followed by these sections,
+ * each of which starts on an 8-byte boundary:
+ *
+ * - temperature thresholds (`temperature_count` signed bytes);
+ * - mode kind of each mode (`mode_count` bytes);
+ * - waveform index for each mode and temperature range
+ *   (`mode_count * (temperature_count - 1)` 32-bit integers);
+ * - index of the end of each waveform in the phase matrices section
+ *   (`waveform_count` 32-bit integers);
+ * - CRC32 checksum of each waveform (`waveform_count` 32-bit integers);
+ * - phase matrices of all waveforms (`matrix_count` matrices).
+ *
+ * The header checksum only covers the sections preceding the phase
+ * matrices, so that loading the cache does not touch the matrices. Each
+ * waveform is checked against its own checksum when first used.
+ */
+constexpr char cache_magic[8] = {'W', 'A', 'V', 'E', 'D', 'W', 'F', 'C'};
+constexpr std::uint32_t cache_version = 3;
+constexpr std::uint32_t cache_byte_order = 0x01020304;
+
+struct cache_header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order; // Equal to `cache_byte_order` in native order
+    std::uint32_t wbf_serial; // Serial number of the source WBF file
+    std::uint32_t wbf_checksum; // CRC32 checksum of the source WBF file
+    std::uint32_t wbf_filesize; // Size of the source WBF file
+    std::uint32_t frame_rate;
+    std::uint32_t mode_count;
+    std::uint32_t temperature_count;
+    std::uint32_t waveform_count;
+    std::uint32_t matrix_count;
+    std::uint32_t size; // Total size of the cache file
+    std::uint32_t checksum; // CRC32 checksum of all sections but matrices
+};
+
+static_assert(
+    sizeof(PhaseMatrix) == intensity_values * intensity_values / 4,
+    "Phase matrices must be stored without padding"
+);
+
+/** Offsets of the sections of a cache file. */
+struct cache_layout {
+    std::uint64_t temperatures;
+    std::uint64_t mode_kinds;
+    std::uint64_t lookup;
+    std::uint64_t waveform_ends;
+    std::uint64_t waveform_checksums;
+    std::uint64_t matrices;
+    std::uint64_t size;
+};
+
+constexpr auto align_section(std::uint64_t offset) -> std::uint64_t
+{
+    return (offset + 7) & ~std::uint64_t{7};
+}
+
+auto compute_cache_layout(const cache_header& header) -> cache_layout
+{
+    cache_layout layout;
+    layout.temperatures = align_section(sizeof(cache_header));
+    layout.mode_kinds = align_section(
+        layout.temperatures + header.temperature_count
+    );
+    layout.lookup = align_section(layout.mode_kinds + header.mode_count);
+    layout.waveform_ends = align_section(
+        layout.lookup
+        + std::uint64_t{header.mode_count} * (header.temperature_count - 1)
+            * sizeof(std::uint32_t)
+    );
+    layout.waveform_checksums = align_section(
+        layout.waveform_ends
+        + std::uint64_t{header.waveform_count} * sizeof(std::uint32_t)
+    );
+    layout.matrices = align_section(
+        layout.waveform_checksums
+        + std::uint64_t{header.waveform_count} * sizeof(std::uint32_t)
+    );
+    layout.size = layout.matrices
+        + std::uint64_t{header.matrix_count} * sizeof(PhaseMatrix);
+    return layout;
+}
+
+} // anonymous namespace
+
+auto WaveformTable::from_cache(const char* path, const Source& source)
+-> std::optional<WaveformTable>
+{
+    std::shared_ptr<const MappedFile> file;
+
+    try {
+        file = std::make_shared<const MappedFile>(path);
+    } catch (const std::system_error& err) {
+        return {};
+    }
+
+    if (file->size() < sizeof(cache_header)) {
+        return {};
+    }
+
+    cache_header header;
+    std::memcpy(&header, file->data(), sizeof(header));
+
+    if (
+        std::memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0
+        || header.version != cache_version
+        || header.byte_order != cache_byte_order
+        || header.wbf_serial != source.serial
+        || header.wbf_checksum != source.checksum
+        || header.wbf_filesize != source.filesize
+        || header.size != file->size()
+        || header.mode_count == 0
+        || header.mode_count > 256
+        || header.temperature_count < 2
+        || header.temperature_count > 256
+    ) {
+        return {};
+    }
+
+    const auto layout = compute_cache_layout(header);
+
+    if (layout.size != header.size) {
+        return {};
+    }
+
+    const char* data = file->data();
+
+    if (header.checksum != crc32_checksum(
+        0,
+        data + sizeof(cache_header),
+        data + layout.matrices
+    )) {
+        return {};
+    }
+
+    const auto* temperatures = reinterpret_cast<const Temperature*>(
+        data + layout.temperatures
+    );
+    const auto* mode_kinds = reinterpret_cast<const std::uint8_t*>(
+        data + layout.mode_kinds
+    );
+    const auto* lookup = reinterpret_cast<const std::uint32_t*>(
+        data + layout.lookup
+    );
+    const auto* waveform_ends = reinterpret_cast<const std::uint32_t*>(
+        data + layout.waveform_ends
+    );
+
+    WaveformTable result;
+    result.frame_rate = header.frame_rate;
+    result.mode_count = header.mode_count;
+    result.temperatures.assign(
+        temperatures, temperatures + header.temperature_count
+    );
+
+    result.mode_kind_by_id.resize(result.mode_count);
+
+    for (ModeID mode = 0; mode < result.mode_count; ++mode) {
+        if (mode_kinds[mode] > static_cast<std::uint8_t>(ModeKind::GLR16)) {
+            return {};
+        }
+
+        auto kind = static_cast<ModeKind>(mode_kinds[mode]);
+        result.mode_kind_by_id[mode] = kind;
+
+        if (kind != ModeKind::UNKNOWN) {
+            result.mode_id_by_kind.insert({kind, mode});
+        }
+    }
+
+    const std::size_t range_count = header.temperature_count - 1;
+    result.waveform_lookup.resize(result.mode_count);
+
+    for (std::size_t mode = 0; mode < result.mode_count; ++mode) {
+        for (std::size_t range = 0; range < range_count; ++range) {
+            auto index = lookup[mode * range_count + range];
+
+            if (index >= header.waveform_count) {
+                return {};
+            }
+
+            result.waveform_lookup[mode].push_back(index);
+        }
+    }
+
+    std::uint32_t end = 0;
+
+    for (std::size_t i = 0; i < header.waveform_count; ++i) {
+        if (waveform_ends[i] < end || waveform_ends[i] > header.matrix_count) {
+            return {};
+        }
+
+        end = waveform_ends[i];
+    }
+
+    if (end != header.matrix_count) {
+        return {};
+    }
+
+    // Keep the file mapped and copy waveforms out of it when first used
+    result.waveform_count = header.waveform_count;
+    result.storage = std::make_shared<Storage>();
+    result.storage->decode = [file, layout](std::size_t index) {
+        const char* data = file->data();
+        const auto* ends = reinterpret_cast<const std::uint32_t*>(
+            data + layout.waveform_ends
+        );
+        const auto* checksums = reinterpret_cast<const std::uint32_t*>(
+            data + layout.waveform_checksums
+        );
+        const auto* matrices = reinterpret_cast<const PhaseMatrix*>(
+            data + layout.matrices
+        );
+
+        const auto* begin = matrices + (index == 0 ? 0 : ends[index - 1]);
+        const auto* end = matrices + ends[index];
+
+        if (checksums[index] != crc32_checksum(
+            0,
+            reinterpret_cast<const std::uint8_t*>(begin),
+            reinterpret_cast<const std::uint8_t*>(end)
+        )) {
+            std::ostringstream message;
+            message << "Corrupted waveform cache: checksum mismatch for "
+                "waveform #" << index;
+            throw std::runtime_error(message.str());
+        }
+
+        return std::vector<PhaseMatrix>(begin, end);
+    };
+
+    return result;
+}
+
+void WaveformTable::write_cache(const char* path, const Source& source) const
+{
+    cache_header header{};
+    std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.version = cache_version;
+    header.byte_order = cache_byte_order;
+    header.wbf_serial = source.serial;
+    header.wbf_checksum = source.checksum;
+    header.wbf_filesize = source.filesize;
+    header.frame_rate = this->frame_rate;
+    header.mode_count = this->mode_count;
+    header.temperature_count = this->temperatures.size();
+    header.waveform_count = this->waveform_count;
+    header.matrix_count = 0;
+
+    // Decode all waveforms without going through the cache of decoded
+    // waveforms, to avoid evicting the ones in use
+    std::vector<std::vector<PhaseMatrix>> waveforms;
+    waveforms.reserve(this->waveform_count);
+
+    for (std::size_t index = 0; index < this->waveform_count; ++index) {
+        waveforms.push_back(this->storage->decode(index));
+        header.matrix_count += waveforms.back().size();
+    }
+
+    const auto layout = compute_cache_layout(header);
+    header.size = layout.size;
+
+    std::vector<char> buffer(layout.size);
+    char* data = buffer.data();
+
+    std::memcpy(
+        data + layout.temperatures,
+        this->temperatures.data(),
+        this->temperatures.size()
+    );
+
+    for (ModeID mode = 0; mode < this->mode_count; ++mode) {
+        data[layout.mode_kinds + mode]
+            = static_cast<char>(this->mode_kind_by_id[mode]);
+    }
+
+    auto* lookup = reinterpret_cast<std::uint32_t*>(data + layout.lookup);
+
+    for (const auto& temp_lookup : this->waveform_lookup) {
+        for (auto index : temp_lookup) {
+            *lookup++ = index;
+        }
+    }
+
+    auto* waveform_ends = reinterpret_cast<std::uint32_t*>(
+        data + layout.waveform_ends
+    );
+    auto* waveform_checksums = reinterpret_cast<std::uint32_t*>(
+        data + layout.waveform_checksums
+    );
+    auto* matrices = reinterpret_cast<PhaseMatrix*>(data + layout.matrices);
+    std::uint32_t end = 0;
+
+    for (const auto& waveform : waveforms) {
+        auto* begin = matrices;
+        matrices = std::copy(waveform.cbegin(), waveform.cend(), matrices);
+        *waveform_checksums++ = crc32_checksum(
+            0,
+            reinterpret_cast<const std::uint8_t*>(begin),
+            reinterpret_cast<const std::uint8_t*>(matrices)
+        );
+        end += waveform.size();
+        *waveform_ends++ = end;
+    }
+
+    header.checksum = crc32_checksum(
+        0,
+        data + sizeof(cache_header),
+        data + layout.matrices
+    );
+    std::memcpy(data, &header, sizeof(header));
+
+    // Write to a temporary file first so that readers never see a
+    // partially written cache
+    const std::string temp_path = std::string(path) + ".tmp";
+
+    {
+        std::ofstream file{temp_path, std::ios::binary | std::ios::trunc};
+
+        if (!file) {
+            throw std::system_error(
+                errno, std::generic_category(), "Open cache file for writing"
+            );
+        }
+
+        file.write(buffer.data(), buffer.size());
+
+        if (!file.flush()) {
+            throw std::system_error(
+                errno, std::generic_category(), "Write cache file"
+            );
+        }
+    }
+
+    if (std::rename(temp_path.c_str(), path) != 0) {
+        throw std::system_error(
+            errno, std::generic_category(), "Replace cache file"
+        );
+    }
+}
+
+auto WaveformTable::discover_cache_file(const char* wbf_path)
+-> std::optional<std::string>
+{
+    fs::path directory;
+
+    if (const char* cache_home = std::getenv("XDG_CACHE_HOME");
+            cache_home != nullptr && *cache_home != '\0') {
+        directory = cache_home;
+    } else if (const char* home = std::getenv("HOME");
+            home != nullptr && *home != '\0') {
+        directory = fs::path(home) / ".cache";
+    } else {
+        return {};
+    }
+
+    directory /= "waved";
+    std::error_code error;
+    fs::create_directories(directory, error);
+
+    if (error) {
+        return {};
+    }
+
+    return (directory / fs::path(wbf_path).filename()).native() + ".cache";
+}
+
 namespace
 {
 
@@ -784,7 +1434,7 @@ auto WaveformTable::discover_wbf_file() -> std::optional<std::string>
         }
 
         try {
-            auto header = parse_header(buffer);
+            auto header = parse_header(buffer.data(), buffer.size());
 
             if (header.fpl_lot == fpl_lot) {
                 return entry.path();
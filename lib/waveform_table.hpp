@@ -12,9 +12,11 @@
 #include <cstdint>
 #include <iostream>
 #include <array>
+#include <memory>
 #include <unordered_map>
 #include <vector>
 #include <optional>
+#include <string>
 
 namespace Waved
 {
@@ -57,15 +59,57 @@ public:
      */
     static WaveformTable from_wbf(std::istream& file);
 
+    /**
+     * Read waveform table definitions from a WBF file, going through a cache
+     * of the decoded tables.
+     *
+     * If the cache file was generated from the same WBF file (as identified
+     * by its serial number, CRC32 checksum and size), the table is loaded
+     * from it directly. Otherwise, the WBF file is parsed and the cache file
+     * is regenerated. Failures to write the cache file are reported on the
+     * standard error but do not prevent loading the table.
+     *
+     * @param path Path to the WBF file.
+     * @param cache_path Path to the cache file.
+     * @return Parsed waveform table.
+     * @throws std::runtime_error If a parsing error occurs.
+     * @throws std::system_error If the WBF file cannot be read.
+     */
+    static WaveformTable from_wbf(const char* path, const char* cache_path);
+
+    /**
+     * Find a suitable location for caching the decoded tables of a WBF file.
+     *
+     * The cache is stored in the `waved` directory of `$XDG_CACHE_HOME`,
+     * or of `$HOME/.cache` if unset. Missing directories are created.
+     *
+     * @param wbf_path Path to the WBF file.
+     * @return Path to the cache file, or nothing if no location is available.
+     */
+    static std::optional<std::string> discover_cache_file(const char* wbf_path);
+
     /**
      * Lookup the waveform for the given mode and temperature.
      *
+     * Waveforms are decoded on first use and the most recently used ones
+     * are kept in memory (see `set_decoded_capacity()`). The returned
+     * waveform stays valid as long as it is referenced, even if it gets
+     * evicted in the meantime. This method is thread-safe.
+     *
      * @param mode Mode ID.
      * @param temperature Temperature in Celsius.
      * @return Corresponding waveform.
      * @throws std::out_of_range If the given temperature is not supported.
+     * @throws std::runtime_error If the waveform data is corrupted.
+     */
+    std::shared_ptr<const Waveform> lookup(ModeID mode, int temperature) const;
+
+    /**
+     * Set the maximum number of decoded waveforms kept in memory.
+     *
+     * @param capacity Number of waveforms (at least 1).
      */
-    const Waveform& lookup(ModeID mode, int temperature) const;
+    void set_decoded_capacity(std::size_t capacity);
 
     using Lookup = std::vector<std::vector<std::size_t>>;
 
@@ -111,13 +155,67 @@ private:
     // The last value is the maximal operating temperature
     std::vector<Temperature> temperatures;
 
-    // All available waveforms. This table may be smaller than
+    // Number of distinct waveforms. This may be smaller than
     // `(temperatures.size() - 1) * mode_count` since some modes/temperatures
     // combinations reuse the same waveform
-    std::vector<Waveform> waveforms;
+    std::size_t waveform_count = 0;
 
-    // Vector for retrieving the waveform for any given mode and temperature
+    // Vector for retrieving the waveform index for any given mode and
+    // temperature
     Lookup waveform_lookup;
+
+    // Encoded waveform data and cache of decoded waveforms, shared between
+    // copies of the table
+    struct Storage;
+    std::shared_ptr<Storage> storage;
+
+    /** Decode a waveform or retrieve it from the cache of decoded ones. */
+    std::shared_ptr<const Waveform> get_waveform(std::size_t index) const;
+
+    /**
+     * Parse a WBF file from memory, without copying it.
+     *
+     * @param owner Object keeping the file contents alive, shared with
+     * the returned table so that waveforms can be decoded on first use.
+     * @param data Start of the file contents.
+     * @param size Size of the file contents.
+     * @throws std::runtime_error If a parsing error occurs.
+     */
+    static WaveformTable parse_wbf(
+        std::shared_ptr<const void> owner,
+        const char* data,
+        std::size_t size
+    );
+
+    /** Identification of the WBF file a table was decoded from. */
+    struct Source
+    {
+        std::uint32_t serial;
+        std::uint32_t checksum;
+        std::uint32_t filesize;
+    };
+
+    /**
+     * Load a table from a cache file.
+     *
+     * @param path Path to the cache file.
+     * @param source Expected source WBF file.
+     * @return Loaded table, or nothing if the cache file does not exist,
+     * is invalid or was generated from another WBF file.
+     */
+    static std::optional<WaveformTable> from_cache(
+        const char* path,
+        const Source& source
+    );
+
+    /**
+     * Save this table to a cache file.
+     *
+     * @param path Path to the cache file.
+     * @param source Source WBF file.
+     * @throws std::system_error If the cache file cannot be written.
+     */
+    void write_cache(const char* path, const Source& source) const;
 }; // class WaveformTable
 
 } // namespace Waved
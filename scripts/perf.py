@@ -8,6 +8,7 @@ def parse_updates_csv(in_file):
     for update in updates:
         update["width"] = int(update["width"])
         update["height"] = int(update["height"])
+        update["transform_duration"] = int(update.get("transform_duration", 0))
         update["queue_time"] = int(update["queue_time"])
         update["dequeue_time"] = int(update["dequeue_time"])
         update["generate_times"] = \
@@ -17,6 +18,8 @@ def parse_updates_csv(in_file):
             list(map(int, update["vsync_times"].split(":"))) \
             if update["vsync_times"] else []
         update["start"] = update["queue_time"]
+        update["first_vsync_latency"] = \
+            int(update.get("first_vsync_latency") or 0)
         update["end"] = update["vsync_times"][-1] \
             if update["vsync_times"] else update["generate_times"][-1]
 
@@ -0,0 +1,791 @@
+/**
+ * @file Measure the performance of the frame generation pipeline.
+ * SPDX-FileCopyrightText: 2021-2022 Mattéo Delabre <git.matteo@delab.re>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "display.hpp"
+#include "pipeline.hpp"
+#include "synthetic_wbf.hpp"
+#include "waveform_table.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace chrono = std::chrono;
+
+namespace
+{
+
+void print_help(std::ostream& out, const char* name)
+{
+    out << "Usage: " << name << " [-h|--help] [-r|--reps N] [-t|--threads N]"
+        " [FILE]\n";
+    out << "Measure the performance of the frame generation pipeline using "
+        "the waveforms\nfrom a WBF file, or synthetic waveforms if no file "
+        "is given.\n";
+}
+
+inline void next_arg(int& argc, const char**& argv)
+{
+    --argc;
+    ++argv;
+}
+
+/** Summary of repeated measurements. */
+struct Stats
+{
+    double median;
+    double min;
+    double max;
+};
+
+auto summarize(std::vector<double> samples) -> Stats
+{
+    std::sort(samples.begin(), samples.end());
+    const auto middle = samples.size() / 2;
+
+    return Stats{
+        samples.size() % 2
+            ? samples[middle]
+            : (samples[middle - 1] + samples[middle]) / 2,
+        samples.front(),
+        samples.back()
+    };
+}
+
+/**
+ * Time a task repeatedly.
+ *
+ * The task is run once before measurements start to warm up caches and
+ * memory pools.
+ *
+ * @param reps Number of measurements.
+ * @param setup Called before each run, outside of the measured time.
+ * @param run Task to measure.
+ * @return Duration of each run in nanoseconds.
+ */
+template<typename Setup, typename Run>
+auto measure(std::size_t reps, Setup setup, Run run) -> std::vector<double>
+{
+    std::vector<double> samples;
+    samples.reserve(reps);
+
+    setup();
+    run();
+
+    for (std::size_t rep = 0; rep < reps; ++rep) {
+        setup();
+        const auto start = chrono::steady_clock::now();
+        run();
+        const auto end = chrono::steady_clock::now();
+        samples.push_back(
+            chrono::duration<double, std::nano>(end - start).count()
+        );
+    }
+
+    return samples;
+}
+
+void print_header()
+{
+    std::cout << std::left
+        << std::setw(18) << "stage"
+        << std::setw(10) << "mode"
+        << std::setw(12) << "size"
+        << std::right
+        << std::setw(12) << "median"
+        << std::setw(12) << "min"
+        << std::setw(12) << "max"
+        << "  unit\n";
+}
+
+void print_row(
+    const std::string& stage,
+    const std::string& mode,
+    const std::string& size,
+    const Stats& stats,
+    const char* unit
+)
+{
+    std::cout << std::left
+        << std::setw(18) << stage
+        << std::setw(10) << mode
+        << std::setw(12) << size
+        << std::right << std::fixed << std::setprecision(3)
+        << std::setw(12) << stats.median
+        << std::setw(12) << stats.min
+        << std::setw(12) << stats.max
+        << "  " << unit << '\n';
+}
+
+auto region_size(const Waved::Region& region) -> std::string
+{
+    return std::to_string(region.width) + "x" + std::to_string(region.height);
+}
+
+/** Divide each sample by a constant. */
+auto scale(std::vector<double> samples, double divisor) -> std::vector<double>
+{
+    for (auto& sample : samples) {
+        sample /= divisor;
+    }
+
+    return samples;
+}
+
+// Size of the reMarkable screen, in its own coordinates
+constexpr std::uint32_t screen_width = 1404;
+constexpr std::uint32_t screen_height = 1872;
+
+// Size of the screen in display coordinates, which are rotated by 90°
+constexpr std::uint32_t display_width = screen_height;
+constexpr std::uint32_t display_height = screen_width;
+
+/** Get a region of the same size anchored at the display origin. */
+auto to_display(const Waved::Region& region) -> Waved::Region
+{
+    return {0, 0, region.height, region.width};
+}
+
+/** Timings of a single update, taken from the display trace. */
+struct UpdateTimes
+{
+    // Time from pushing the update to it being displayed, in nanoseconds
+    double latency = 0;
+
+    // Time spent converting the update pixels, in nanoseconds
+    double transform = 0;
+
+    // Time from activating the update to generating its last frame, in
+    // nanoseconds, and number of generated frames
+    double generate = 0;
+    std::size_t frames = 0;
+};
+
+/**
+ * Runs updates through a display using its public interface, and reads
+ * the time spent in each stage of the pipeline from its trace.
+ */
+class Bench
+{
+public:
+    Bench(
+        Waved::Display& display,
+        std::vector<Waved::ModeKind> modes,
+        std::size_t reps
+    )
+    : display(display)
+    , modes(std::move(modes))
+    , reps(reps)
+    {}
+
+    /** Regions to benchmark, in screen coordinates. */
+    static auto get_regions() -> std::vector<Waved::Region>
+    {
+        return {
+            {0, 0, 64, 64},
+            {0, 0, 256, 256},
+            {0, 0, 512, 512},
+            {0, 0, screen_width, screen_height},
+        };
+    }
+
+    /** Measure the conversion of incoming pixels in `push_update()`. */
+    void bench_transform(const Waved::Region& region)
+    {
+        const struct {
+            Waved::PixelFormat format;
+            bool dither;
+            const char* name;
+        } formats[] = {
+            {Waved::PixelFormat::Intensity, false, "intensity"},
+            {Waved::PixelFormat::Y8, false, "y8"},
+            {Waved::PixelFormat::Y8, true, "y8-dith"},
+            {Waved::PixelFormat::RGB565, false, "rgb565"},
+            {Waved::PixelFormat::RGB565, true, "565-dith"},
+        };
+
+        const std::size_t pixels = region.width * region.height;
+        std::vector<std::uint8_t> image(pixels * 2);
+        std::uniform_int_distribution<int> byte(0, 255);
+
+        for (auto& value : image) {
+            value = byte(this->random);
+        }
+
+        for (const auto& [format, dither, format_name] : formats) {
+            const std::size_t depth
+                = format == Waved::PixelFormat::RGB565 ? 2 : 1;
+            this->display.set_dithering(dither);
+
+            const auto samples = this->run_updates(
+                Waved::ModeKind::DU, region,
+                image.data(), region.width * depth, format
+            );
+
+            print_row(
+                "push_update", format_name, region_size(region),
+                summarize(scale(get_transform(samples), pixels)), "ns/px"
+            );
+        }
+
+        this->display.set_dithering(false);
+    }
+
+    /**
+     * Measure the time taken by an update to be displayed, and the
+     * generation of its frames.
+     */
+    void bench_update(Waved::ModeID mode, const Waved::Region& region)
+    {
+        const auto image = this->make_image(mode, region);
+        const std::size_t pixels = region.width * region.height;
+        const auto samples = this->run_updates(
+            mode, region,
+            image.data(), region.width, Waved::PixelFormat::Intensity
+        );
+
+        if (samples.front().frames == 0) {
+            std::cerr << "[warn] Update has no effect in mode "
+                << this->mode_name(mode) << '\n';
+            return;
+        }
+
+        print_row(
+            "update_latency", this->mode_name(mode), region_size(region),
+            summarize(scale(get_latency(samples), 1e6)), "ms"
+        );
+
+        const auto frame_samples = get_generate(samples);
+        print_row(
+            "generate_frames", this->mode_name(mode), region_size(region),
+            summarize(scale(frame_samples, pixels)), "ns/px/frame"
+        );
+
+        auto rates = frame_samples;
+
+        for (auto& rate : rates) {
+            rate = 1e9 / rate;
+        }
+
+        print_row(
+            "generate_frames", this->mode_name(mode), region_size(region),
+            summarize(rates), "frames/s"
+        );
+    }
+
+    /** Measure the merging of two side-by-side updates. */
+    void bench_merge(Waved::ModeID mode, const Waved::Region& region)
+    {
+        const auto merged = to_display(region);
+
+        Waved::Region left = merged;
+        left.width /= 2;
+
+        Waved::Region right = left;
+        right.left += left.width;
+
+        const auto first = this->make_image(mode, left);
+        const auto second = this->make_image(mode, right);
+
+        const auto samples = measure(
+            this->reps,
+            []{},
+            [&]{
+                std::vector<Waved::Intensity> buffer(
+                    merged.width * merged.height
+                );
+
+                Waved::merge_rects(
+                    this->current.data(), display_width, merged,
+                    left, first.data(),
+                    right, second.data(),
+                    buffer.data()
+                );
+            }
+        );
+
+        print_row(
+            "merge_update", this->mode_name(mode), region_size(region),
+            summarize(scale(samples, region.width * region.height)), "ns/px"
+        );
+    }
+
+    /** Measure the alignment of an update on both sides. */
+    void bench_align(Waved::ModeID mode, const Waved::Region& region)
+    {
+        Waved::Region unaligned = to_display(region);
+        unaligned.left += 3;
+        unaligned.width -= 6;
+
+        const auto source = this->make_image(mode, unaligned);
+        Waved::Region aligned;
+        std::vector<Waved::Intensity> buffer;
+
+        const auto samples = measure(
+            this->reps,
+            [&]{
+                aligned = unaligned;
+                buffer = source;
+            },
+            [&]{
+                Waved::align_rect(
+                    this->current.data(), display_width, aligned, buffer
+                );
+            }
+        );
+
+        print_row(
+            "align_update", this->mode_name(mode), region_size(region),
+            summarize(scale(samples, region.width * region.height)), "ns/px"
+        );
+    }
+
+    /** Measure the search for consecutive identical transitions. */
+    void bench_consecutive(Waved::ModeID mode, const Waved::Region& region)
+    {
+        const auto target = to_display(region);
+        const auto image = this->make_image(mode, target);
+        std::vector<bool> result;
+        Waved::TransitionMask mask;
+
+        const auto samples = measure(
+            this->reps,
+            []{},
+            [&]{
+                Waved::find_consecutive(
+                    this->current.data(), display_width,
+                    image.data(), target.width, target.height,
+                    result, mask
+                );
+            }
+        );
+
+        print_row(
+            "check_consecutive", this->mode_name(mode), region_size(region),
+            summarize(scale(samples, region.width * region.height)), "ns/px"
+        );
+    }
+
+    /** Measure copying the recorded frames of a compiled update. */
+    void bench_replay(Waved::ModeID mode, const Waved::Region& region)
+    {
+        const auto image = this->make_image(mode, region);
+        const auto compiled = this->display.compile_update(
+            mode, region,
+            image.data(), region.width, Waved::PixelFormat::Intensity
+        );
+
+        if (!compiled) {
+            return;
+        }
+
+        // The first push records the frames, which later pushes replay
+        const auto samples = this->run_updates([&]{
+            return this->display.push_update(compiled);
+        });
+
+        if (samples.front().frames == 0) {
+            return;
+        }
+
+        print_row(
+            "replay_frames", this->mode_name(mode), region_size(region),
+            summarize(scale(
+                get_generate(samples),
+                region.width * region.height
+            )), "ns/px/frame"
+        );
+    }
+
+    auto get_mode_count() const -> Waved::ModeID
+    {
+        return this->modes.size();
+    }
+
+    auto mode_name(Waved::ModeID mode) const -> std::string
+    {
+        return Waved::mode_kind_to_string(this->modes[mode]);
+    }
+
+private:
+    Waved::Display& display;
+    std::vector<Waved::ModeKind> modes;
+    std::size_t reps;
+
+    // Source of the update contents
+    std::mt19937 random{1};
+
+    // Intensities that the stages measured outside of the display start
+    // from, in display coordinates
+    std::vector<Waved::Intensity> current = std::vector<Waved::Intensity>(
+        display_width * display_height, 0
+    );
+
+    /**
+     * Create an image with contents that use the intensities supported
+     * by a mode, different from the all-black intensities restored
+     * between updates.
+     */
+    auto make_image(Waved::ModeID mode, const Waved::Region& region)
+        -> std::vector<Waved::Intensity>
+    {
+        const auto kind = this->modes[mode];
+        const bool binary = (
+            kind == Waved::ModeKind::A2
+            || kind == Waved::ModeKind::DU
+        );
+        std::uniform_int_distribution<int> level(binary ? 1 : 0, 15);
+        std::vector<Waved::Intensity> image(region.width * region.height);
+
+        for (auto& value : image) {
+            value = binary ? 30 : level(this->random) * 2;
+        }
+
+        // Keep part of binary updates unchanged
+        if (binary) {
+            for (std::size_t i = 0; i < image.size(); i += 3) {
+                image[i] = 0;
+            }
+        }
+
+        return image;
+    }
+
+    /** Display the same update repeatedly, starting from a black region. */
+    template<typename Mode>
+    auto run_updates(
+        Mode mode,
+        const Waved::Region& region,
+        const void* data,
+        std::size_t stride,
+        Waved::PixelFormat format
+    ) -> std::vector<UpdateTimes>
+    {
+        return this->run_updates([&]{
+            return this->display.push_update(
+                mode, region, data, stride, format
+            );
+        });
+    }
+
+    template<typename Push>
+    auto run_updates(Push push) -> std::vector<UpdateTimes>
+    {
+        // Region covering all benchmarked regions, cleared before each run
+        const Waved::Region screen{0, 0, screen_width, screen_height};
+        const std::vector<Waved::Intensity> black(
+            screen_width * screen_height, 0
+        );
+
+        std::vector<UpdateTimes> samples;
+        samples.reserve(this->reps);
+
+        // The first run warms up caches and memory pools
+        for (std::size_t rep = 0; rep <= this->reps; ++rep) {
+            if (auto id = this->display.push_update(
+                Waved::ModeKind::DU, screen, black
+            )) {
+                this->display.wait_for(*id);
+            }
+
+            this->display.pull_trace();
+
+            const auto start = chrono::steady_clock::now();
+            const auto id = push();
+
+            if (!id) {
+                std::cerr << "[warn] Update was rejected\n";
+                break;
+            }
+
+            this->display.wait_for(*id);
+            const auto end = chrono::steady_clock::now();
+
+            auto times = get_times(
+                static_cast<std::uint32_t>(*id),
+                this->display.pull_trace()
+            );
+            times.latency = chrono::duration<double, std::nano>(
+                end - start
+            ).count();
+
+            if (rep > 0) {
+                samples.push_back(times);
+            }
+        }
+
+        if (samples.empty()) {
+            samples.emplace_back();
+        }
+
+        return samples;
+    }
+
+    /** Find the timings of an update in a trace. */
+    static auto get_times(
+        std::uint32_t id,
+        const std::vector<Waved::TraceEvent>& events
+    ) -> UpdateTimes
+    {
+        UpdateTimes times;
+        const Waved::TraceEvent* activate = nullptr;
+
+        for (const auto& event : events) {
+            switch (event.type) {
+            case Waved::TraceEventType::Queue:
+                if (event.id == id) {
+                    times.transform = event.value * 1e3;
+                }
+                break;
+
+            case Waved::TraceEventType::Activate:
+                if (event.id == id) {
+                    activate = &event;
+                    times.frames = event.value;
+                }
+                break;
+
+            case Waved::TraceEventType::Generate:
+                // Frames are numbered in generation order, and the update
+                // has frames from its activation up to its frame count
+                if (
+                    activate != nullptr
+                    && event.frame + 1 == activate->frame + activate->value
+                ) {
+                    times.generate = (event.time - activate->time) * 1e3;
+                }
+                break;
+
+            default:
+                break;
+            }
+        }
+
+        return times;
+    }
+
+    static auto get_transform(const std::vector<UpdateTimes>& samples)
+        -> std::vector<double>
+    {
+        std::vector<double> result;
+
+        for (const auto& sample : samples) {
+            result.push_back(sample.transform);
+        }
+
+        return result;
+    }
+
+    static auto get_latency(const std::vector<UpdateTimes>& samples)
+        -> std::vector<double>
+    {
+        std::vector<double> result;
+
+        for (const auto& sample : samples) {
+            result.push_back(sample.latency);
+        }
+
+        return result;
+    }
+
+    /** Get the generation time per frame of each sample. */
+    static auto get_generate(const std::vector<UpdateTimes>& samples)
+        -> std::vector<double>
+    {
+        std::vector<double> result;
+
+        for (const auto& sample : samples) {
+            result.push_back(
+                sample.frames ? sample.generate / sample.frames : 0
+            );
+        }
+
+        return result;
+    }
+}; // class Bench
+
+} // anonymous namespace
+
+int main(int argc, const char** argv)
+{
+    const char* name = argv[0];
+    const char* wbf_path = nullptr;
+    std::size_t reps = 20;
+    std::size_t threads = 1;
+    next_arg(argc, argv);
+
+    while (argc) {
+        const std::string arg = argv[0];
+
+        if (arg == "-h" || arg == "--help") {
+            print_help(std::cout, name);
+            return 0;
+        }
+
+        if ((arg == "-r" || arg == "--reps") && argc >= 2) {
+            reps = std::max(std::atoi(argv[1]), 1);
+            next_arg(argc, argv);
+        } else if ((arg == "-t" || arg == "--threads") && argc >= 2) {
+            threads = std::max(std::atoi(argv[1]), 1);
+            next_arg(argc, argv);
+        } else if (arg[0] != '-' && wbf_path == nullptr) {
+            wbf_path = argv[0];
+        } else {
+            print_help(std::cerr, name);
+            return 1;
+        }
+
+        next_arg(argc, argv);
+    }
+
+    // Load waveforms
+    std::string wbf_data;
+
+    if (wbf_path != nullptr) {
+        std::ifstream file{wbf_path, std::ios::binary};
+
+        if (!file) {
+            std::cerr << "I/O error: Cannot open " << wbf_path << '\n';
+            return 1;
+        }
+
+        std::ostringstream contents;
+        contents << file.rdbuf();
+        wbf_data = contents.str();
+    } else {
+        wbf_data = make_synthetic_wbf();
+    }
+
+    Waved::WaveformTable table;
+
+    try {
+        std::istringstream stream{wbf_data};
+        table = Waved::WaveformTable::from_wbf(stream);
+    } catch (const std::runtime_error& err) {
+        std::cerr << "Parse error: " << err.what() << '\n';
+        return 1;
+    }
+
+    std::cout << "Waveforms: " << (wbf_path ? wbf_path : "synthetic")
+        << ", " << reps << " reps, " << threads << " thread(s)\n";
+#ifdef DRY_RUN
+    std::cout << "Dry run build: frames are generated without a display\n";
+#else
+    std::cout << "Frames are sent to the display, which paces their "
+        "generation once the\nframe ring is full\n";
+#endif // DRY_RUN
+    std::cout << '\n';
+    print_header();
+
+    const auto parse_samples = measure(
+        reps,
+        []{},
+        [&]{
+            std::istringstream stream{wbf_data};
+            Waved::WaveformTable::from_wbf(stream);
+        }
+    );
+
+    print_row(
+        "from_wbf", "-", std::to_string(wbf_data.size() / 1024) + "K",
+        summarize(scale(parse_samples, 1e3)), "us"
+    );
+
+    // Parse the same file in place from a memory mapping
+    char wbf_file_path[] = "/tmp/waved-bench-XXXXXX";
+    const int wbf_fd = mkstemp(wbf_file_path);
+
+    if (
+        wbf_fd == -1
+        || write(wbf_fd, wbf_data.data(), wbf_data.size())
+            != static_cast<ssize_t>(wbf_data.size())
+    ) {
+        std::cerr << "I/O error: Cannot create WBF file\n";
+        return 1;
+    }
+
+    close(wbf_fd);
+
+    const auto map_samples = measure(
+        reps,
+        []{},
+        [&]{
+            Waved::WaveformTable::from_wbf(wbf_file_path);
+        }
+    );
+
+    unlink(wbf_file_path);
+
+    print_row(
+        "from_wbf_mmap", "-", std::to_string(wbf_data.size() / 1024) + "K",
+        summarize(scale(map_samples, 1e3)), "us"
+    );
+
+    std::vector<Waved::ModeKind> modes;
+
+    for (Waved::ModeID mode = 0; mode < table.get_mode_count(); ++mode) {
+        modes.push_back(table.get_mode_kind(mode));
+    }
+
+#ifdef DRY_RUN
+    // Neither device is accessed in dry-run builds
+    const std::optional<std::string> framebuffer_path = "/dev/null";
+    const std::optional<std::string> sensor_path = "/dev/null";
+#else
+    const auto framebuffer_path = Waved::Display::discover_framebuffer();
+
+    if (!framebuffer_path) {
+        std::cerr << "[init] Cannot find framebuffer device\n";
+        return 2;
+    }
+
+    const auto sensor_path = Waved::Display::discover_temperature_sensor();
+
+    if (!sensor_path) {
+        std::cerr << "[init] Cannot find temperature sensor\n";
+        return 3;
+    }
+#endif // DRY_RUN
+
+    Waved::Display display{
+        framebuffer_path->data(),
+        sensor_path->data(),
+        std::move(table)
+    };
+
+    display.set_generator_thread_count(threads);
+    display.set_tracing(true);
+    display.start();
+
+    Bench bench{display, std::move(modes), reps};
+
+    for (const auto& region : Bench::get_regions()) {
+        bench.bench_transform(region);
+    }
+
+    for (Waved::ModeID mode = 0; mode < bench.get_mode_count(); ++mode) {
+        for (const auto& region : Bench::get_regions()) {
+            bench.bench_merge(mode, region);
+            bench.bench_align(mode, region);
+            bench.bench_consecutive(mode, region);
+            bench.bench_update(mode, region);
+            bench.bench_replay(mode, region);
+        }
+    }
+
+    display.stop();
+    return 0;
+}
@@ -0,0 +1,236 @@
+/**
+ * @file Generate a synthetic WBF file for benchmarking.
+ * SPDX-FileCopyrightText: 2021-2022 Mattéo Delabre <git.matteo@delab.re>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "synthetic_wbf.hpp"
+#include "defs.hpp"
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <vector>
+#include "checksum.tpp"
+
+namespace
+{
+
+using Waved::Intensity;
+using Waved::Phase;
+using Waved::PhaseMatrix;
+using Waved::intensity_values;
+
+using Bytes = std::vector<std::uint8_t>;
+using Matrices = std::vector<PhaseMatrix>;
+
+// Lower bounds of the temperature ranges, plus the upper bound of the last one
+const std::int8_t temperatures[] = {0, 10, 20, 30, 40, 50};
+constexpr std::size_t temp_range_count = std::size(temperatures) - 1;
+
+// Number of frames of each mode in the warmest temperature range. Colder
+// ranges use longer waveforms
+enum Mode { Init, DU, GC16, A2, mode_count };
+constexpr std::size_t mode_lengths[] = {40, 12, 45, 7};
+
+/** Build the matrices of a mode for a given temperature range. */
+auto make_waveform(Mode mode, std::size_t range) -> Matrices
+{
+    const std::size_t length = mode_lengths[mode]
+        + 2 * (temp_range_count - 1 - range);
+    Matrices result(length);
+
+    for (std::size_t frame = 0; frame < length; ++frame) {
+        auto& matrix = result[frame];
+
+        for (Intensity from = 0; from < intensity_values; ++from) {
+            for (Intensity to = 0; to < intensity_values; ++to) {
+                Phase phase = Phase::Noop;
+
+                switch (mode) {
+                case Init:
+                    // Flash all cells regardless of their intensity,
+                    // ending on white
+                    phase = (length - frame) % 2 ? Phase::White : Phase::Black;
+                    break;
+
+                case DU:
+                    // Drive to black or white from any intensity
+                    if (
+                        from != to && (to == 0 || to == 30)
+                        && frame > 0 && frame + 1 < length
+                    ) {
+                        phase = to == 0 ? Phase::Black : Phase::White;
+                    }
+                    break;
+
+                case GC16:
+                    // Flash to white then to black, then drive towards
+                    // the target intensity, for all even intensities
+                    if (from % 2 == 0 && to % 2 == 0) {
+                        const std::size_t third = length / 3;
+
+                        if (frame < third) {
+                            phase = Phase::White;
+                        } else if (frame < 2 * third) {
+                            phase = Phase::Black;
+                        } else if (frame - 2 * third < to * third / 30) {
+                            phase = Phase::White;
+                        }
+                    }
+                    break;
+
+                case A2:
+                    // Only switch between black and white
+                    if ((from == 0 && to == 30) || (from == 30 && to == 0)) {
+                        if (frame > 0) {
+                            phase = to == 0 ? Phase::Black : Phase::White;
+                        }
+                    }
+                    break;
+
+                default:
+                    break;
+                }
+
+                matrix.set(from, to, phase);
+            }
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Encode the matrices of a waveform block using repeat mode, ending with
+ * the end marker and a two-byte checksum that is not verified.
+ */
+void encode_waveform(Bytes& out, const Matrices& matrices)
+{
+    Bytes packed;
+
+    for (const auto& matrix : matrices) {
+        for (Intensity to = 0; to < intensity_values; ++to) {
+            for (Intensity from = 0; from < intensity_values; from += 4) {
+                packed.push_back(
+                    static_cast<std::uint8_t>(matrix.get(from, to)) << 6
+                    | static_cast<std::uint8_t>(matrix.get(from + 1, to)) << 4
+                    | static_cast<std::uint8_t>(matrix.get(from + 2, to)) << 2
+                    | static_cast<std::uint8_t>(matrix.get(from + 3, to))
+                );
+            }
+        }
+    }
+
+    // Since phases never equal 3, packed bytes never collide with the
+    // 0xFC and 0xFF markers
+    for (std::size_t i = 0; i < packed.size();) {
+        std::size_t repeat = 1;
+
+        while (
+            i + repeat < packed.size()
+            && packed[i + repeat] == packed[i]
+            && repeat < 256
+        ) {
+            ++repeat;
+        }
+
+        out.push_back(packed[i]);
+        out.push_back(static_cast<std::uint8_t>(repeat - 1));
+        i += repeat;
+    }
+
+    out.push_back(0xFF);
+    out.push_back(0x00);
+    out.push_back(0x00);
+    out.push_back(0x00);
+}
+
+/** Write a 24-bit pointer field followed by its checksum. */
+void write_pointer(Bytes& out, std::size_t offset, std::uint32_t pointer)
+{
+    out[offset] = pointer & 0xFF;
+    out[offset + 1] = (pointer >> 8) & 0xFF;
+    out[offset + 2] = (pointer >> 16) & 0xFF;
+    out[offset + 3] = Waved::basic_checksum(
+        out.cbegin() + offset,
+        out.cbegin() + offset + 3
+    );
+}
+
+/** Write a little-endian 32-bit field. */
+void write_u32(Bytes& out, std::size_t offset, std::uint32_t value)
+{
+    for (std::size_t i = 0; i < 4; ++i) {
+        out[offset + i] = (value >> (i * 8)) & 0xFF;
+    }
+}
+
+} // anonymous namespace
+
+auto make_synthetic_wbf() -> std::string
+{
+    constexpr std::size_t header_size = 48;
+    Bytes out(header_size);
+
+    // Temperature table, followed by its checksum
+    for (auto temperature : temperatures) {
+        out.push_back(static_cast<std::uint8_t>(temperature));
+    }
+
+    out.push_back(
+        Waved::basic_checksum(out.cbegin() + header_size, out.cend())
+    );
+
+    // Extra information, containing the file name
+    const char name[] = "synthetic.wbf";
+    out.push_back(std::strlen(name));
+    out.insert(out.end(), name, name + std::strlen(name));
+    out.push_back(0);
+
+    // Table of pointers to the mode tables, and mode tables of pointers
+    // to the waveform blocks for each temperature range
+    const std::size_t modes_offset = out.size();
+    out.resize(out.size() + 4 * mode_count);
+
+    std::size_t ranges_offsets[mode_count];
+
+    for (std::size_t mode = 0; mode < mode_count; ++mode) {
+        ranges_offsets[mode] = out.size();
+        write_pointer(out, modes_offset + 4 * mode, out.size());
+        out.resize(out.size() + 4 * temp_range_count);
+    }
+
+    for (std::size_t mode = 0; mode < mode_count; ++mode) {
+        for (std::size_t range = 0; range < temp_range_count; ++range) {
+            write_pointer(out, ranges_offsets[mode] + 4 * range, out.size());
+            encode_waveform(
+                out,
+                make_waveform(static_cast<Mode>(mode), range)
+            );
+        }
+    }
+
+    // Header fields, with the values expected by the parser
+    write_u32(out, 4, out.size()); // filesize
+    write_u32(out, 8, 1); // serial
+    out[12] = 17; // run_type
+    out[16] = 25; // adhesive_run
+    out[19] = 81; // waveform_type
+    out[23] = 0x85; // old_frame_rate
+    out[24] = 85; // frame_rate
+    out[31] = Waved::basic_checksum(out.cbegin() + 8, out.cbegin() + 31);
+    out[35] = 1; // fvsn
+    out[36] = 4; // luts
+    out[37] = mode_count - 1;
+    out[38] = temp_range_count - 1;
+    out[39] = 3; // advanced_wfm_flags
+    out[47] = Waved::basic_checksum(out.cbegin() + 32, out.cbegin() + 47);
+
+    // CRC32 over the whole file, with the checksum field set to zero
+    const std::uint8_t zeroes[] = {0, 0, 0, 0};
+    std::uint32_t crc = Waved::crc32_checksum(0, zeroes, zeroes + 4);
+    crc = Waved::crc32_checksum(crc, out.cbegin() + 4, out.cend());
+    write_u32(out, 0, crc);
+
+    return {out.cbegin(), out.cend()};
+}
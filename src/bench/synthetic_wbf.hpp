@@ -0,0 +1,24 @@
+/**
+ * @file Generate a synthetic WBF file for benchmarking.
+ * SPDX-FileCopyrightText: 2021-2022 Mattéo Delabre <git.matteo@delab.re>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef WAVED_BENCH_SYNTHETIC_WBF_HPP
+#define WAVED_BENCH_SYNTHETIC_WBF_HPP
+
+#include <string>
+
+/**
+ * Build the contents of a WBF file that can be parsed by
+ * `WaveformTable::from_wbf()` without a device-specific file.
+ *
+ * The file contains an INIT, a DU, a GC16 and an A2 mode, in this
+ * order, over 5 temperature ranges from 0 to 50 °C. The waveforms do
+ * not produce sensible images but drive the same sets of transitions
+ * with similar lengths as the ones shipped with the reMarkable 2, so
+ * that they exercise the same frame generation paths.
+ */
+std::string make_synthetic_wbf();
+
+#endif // WAVED_BENCH_SYNTHETIC_WBF_HPP
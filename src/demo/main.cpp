@@ -11,6 +11,7 @@
 #include <sstream>
 #include <cerrno>
 #include <cstring>
+#include <memory>
 #include <string>
 #include <thread>
 #include <chrono>
@@ -18,14 +19,23 @@
 
 void do_init(Waved::Display& display)
 {
-    display.push_update(
-        Waved::ModeKind::INIT,
-        Waved::Region{
-            /* top = */ 0, /* left = */ 0,
-            /* width = */ 1404, /* height = */ 1872
-        },
-        std::vector<Waved::Intensity>(1404 * 1872, 30)
-    );
+    // The screen is cleared between each test, so its frames are only
+    // generated the first time and replayed afterwards
+    static std::shared_ptr<Waved::CompiledUpdate> init;
+
+    if (!init) {
+        const std::vector<Waved::Intensity> white(1404 * 1872, 30);
+        init = display.compile_update(
+            Waved::ModeKind::INIT,
+            Waved::Region{
+                /* top = */ 0, /* left = */ 0,
+                /* width = */ 1404, /* height = */ 1872
+            },
+            white.data(), 1404, Waved::PixelFormat::Intensity
+        );
+    }
+
+    display.push_update(init);
 }
 
 void do_block_gradients(Waved::Display& display)
@@ -271,17 +281,9 @@ void do_image(Waved::Display& display)
 
 void print_help(std::ostream& out, const char* name)
 {
-#ifdef ENABLE_PERF_REPORT
     out << "Usage: " << name << " [-h|--help] [PERF_OUT]\n";
-#else
-    out << "Usage: " << name << " [-h|--help]\n";
-#endif
     out << "Run waved tests.\n";
-#ifdef ENABLE_PERF_REPORT
     out << "Dump performance report in PERF_OUT (in CSV format).\n";
-#else
-    out << "Performance reports disabled at compile time.\n";
-#endif
 }
 
 inline void next_arg(int& argc, const char**& argv)
@@ -301,14 +303,12 @@ int main(int argc, const char** argv)
         return 0;
     }
 
-#ifdef ENABLE_PERF_REPORT
     std::ofstream perf_report_out;
 
     if (argc) {
         perf_report_out.open(argv[0]);
         next_arg(argc, argv);
     }
-#endif
 
     auto wbf_path = Waved::WaveformTable::discover_wbf_file();
 
@@ -319,7 +319,21 @@ int main(int argc, const char** argv)
         std::cerr << "[init] Using waveform file: " << *wbf_path << '\n';
     }
 
-    auto table = Waved::WaveformTable::from_wbf(wbf_path->data());
+    auto cache_path = Waved::WaveformTable::discover_cache_file(
+        wbf_path->data()
+    );
+    Waved::WaveformTable table;
+
+    if (cache_path) {
+        std::cerr << "[init] Using waveform cache: " << *cache_path << '\n';
+        table = Waved::WaveformTable::from_wbf(
+            wbf_path->data(),
+            cache_path->data()
+        );
+    } else {
+        table = Waved::WaveformTable::from_wbf(wbf_path->data());
+    }
+
     auto framebuffer_path = Waved::Display::discover_framebuffer();
 
     if (!framebuffer_path) {
@@ -346,48 +360,64 @@ int main(int argc, const char** argv)
         std::move(table),
     };
 
+    // Collect the performance report after each test, before the
+    // trace events of the next tests overwrite those of earlier ones
+    bool perf_report_header = true;
+
+    auto save_perf_report = [&]() {
+        if (perf_report_out) {
+            perf_report_out << display.get_perf_report(perf_report_header);
+            perf_report_header = false;
+        }
+    };
+
+    display.set_tracing(static_cast<bool>(perf_report_out));
     display.start();
 
     std::cerr << "[test] Block gradients\n";
     do_init(display);
     do_block_gradients(display);
     std::this_thread::sleep_for(15s);
+    save_perf_report();
 
     std::cerr << "[test] Continuous gradients\n";
     do_init(display);
     do_continuous_gradients(display);
     std::this_thread::sleep_for(15s);
+    save_perf_report();
 
     std::cerr << "[test] Image\n";
     do_init(display);
     do_image(display);
     std::this_thread::sleep_for(5s);
+    save_perf_report();
 
     std::cerr << "[test] All different values\n";
     do_init(display);
     do_all_diff(display);
     std::this_thread::sleep_for(15s);
+    save_perf_report();
 
     std::cerr << "[test] Random values\n";
     do_init(display);
     do_random(display);
     std::this_thread::sleep_for(15s);
+    save_perf_report();
 
     std::cerr << "[test] Spiral\n";
     do_init(display);
     std::this_thread::sleep_for(4s);
     do_spiral(display);
     std::this_thread::sleep_for(5s);
+    save_perf_report();
 
     std::cerr << "[test] End\n";
     do_init(display);
     std::this_thread::sleep_for(3s);
+    save_perf_report();
 
-#ifdef ENABLE_PERF_REPORT
-    if (perf_report_out) {
-        perf_report_out << display.get_perf_report();
-    }
-#endif
+    std::cerr << "[test] Late frames: " << display.get_missed_vsync_count()
+        << '\n';
 
     return 0;
 }
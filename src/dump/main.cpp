@@ -101,7 +101,7 @@ int main(int argc, const char** argv)
     int temperature = std::stoi(argv[1]);
 
     try {
-        const auto& waveform = table.lookup(mode, temperature);
+        auto waveform = table.lookup(mode, temperature);
         std::cerr << "Listing waveforms for mode " << mode << " and "
             "temperature " << temperature << " °C\n"
             "(No-op waveforms are not shown)\n\n";
@@ -109,10 +109,10 @@ int main(int argc, const char** argv)
         for (Waved::Intensity from = 0; from < Waved::intensity_values; ++from) {
             for (Waved::Intensity to = 0; to < Waved::intensity_values; ++to) {
                 if (std::all_of(
-                    std::cbegin(waveform),
-                    std::cend(waveform),
+                    std::cbegin(*waveform),
+                    std::cend(*waveform),
                     [from, to](const auto& matrix) {
-                        return matrix[from][to] == Waved::Phase::Noop;
+                        return matrix.get(from, to) == Waved::Phase::Noop;
                     }
                 )) {
                     // Skip no-op waveforms
@@ -122,8 +122,8 @@ int main(int argc, const char** argv)
                 std::cerr << "(" << std::setw(2) << static_cast<int>(from)
                     << " -> " << std::setw(2) << static_cast<int>(to) << "): ";
 
-                for (const auto& matrix : waveform) {
-                    std::cout << static_cast<int>(matrix[from][to]);
+                for (const auto& matrix : *waveform) {
+                    std::cout << static_cast<int>(matrix.get(from, to));
                 }
 
                 std::cerr << '\n';
@@ -1,6 +1,7 @@
 // This code is adapted from ddvk/remarkable2-framebuffer
 #pragma once
 
+#include <errno.h>
 #include <string.h>
 #include <sys/ipc.h>
 #include <sys/mman.h>
@@ -101,6 +102,21 @@ public:
     return {};
   }
 
+  // Receive a message if one is ready, without blocking
+  bool try_recv(swtfb_update &buf) {
+    auto len = msgrcv(msqid, &buf, sizeof(buf.mdata), 0,
+                      MSG_NOERROR | IPC_NOWAIT);
+    if (len >= 0) {
+      return true;
+    }
+
+    if (errno != ENOMSG) {
+      perror("Error recv msgbuf");
+    }
+
+    return false;
+  }
+
   void destroy() { msgctl(msqid, IPC_RMID, 0); };
 };
 }; // namespace ipc
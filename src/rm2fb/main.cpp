@@ -1,9 +1,24 @@
 #include "display.hpp"
 #include "ipc.cpp"
-#include <semaphore.h> // sem_open
+#include "shadow.hpp"
+#include "waiters.hpp"
+#include <fcntl.h>
+#include <linux/input.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Amount of logging: 0 for errors only, 1 for notable events, 2 for
+// every message. Set from the WAVED_VERBOSITY environment variable
+int verbosity = 1;
 
-#define DEBUG
-#define DEBUG_DIRTY
 int msg_q_id = 0x2257c;
 swtfb::ipc::Queue MSGQ(msg_q_id);
 
@@ -12,36 +27,29 @@ uint16_t *SHARED_MEM;
 #define WIDTH 1404
 #define HEIGHT 1872
 
-// convert an RGB565_LE to floating point number
-// TODO: verify this is correct
-constexpr float to_float(uint16_t c)
-{
-    // 0.21 R + 0.72 G + 0.07 B
-    return ((c >> 11) & 31) * (0.21 / 31)  // red
-         + ((c >> 5)  & 63) * (0.72 / 63)  // green
-         + (c         & 31) * (0.07 / 31); // blue
-}
+// Maximum number of messages handled in a single batch
+constexpr std::size_t max_batch = 64;
+
+// Update requested by a client, in screen coordinates
+struct PendingUpdate {
+  int waveform;
+  Waved::Region region;
+
+  // Whether all pixels of the region are to be refreshed, instead of only
+  // the ones that changed
+  bool full;
+};
 
-void do_update(Waved::Display &display, const swtfb::swtfb_update &s) {
+PendingUpdate parse_update(const swtfb::swtfb_update &s) {
 
   auto mxcfb_update = s.mdata.update;
   auto rect = mxcfb_update.update_region;
-  std::vector<Waved::Intensity> buffer(rect.width * rect.height);
 
-#ifdef DEBUG_DIRTY
-  std::cerr << "Dirty Region: " << rect.left << " " << rect.top << " "
-            << rect.width << " " << rect.height << std::endl;
-#endif
-
-  // TODO: verify that the rectangle is within SHARED_MEM's bounds, otherwise the server will crash
-  for (unsigned int i = 0; i < rect.height; i++) {
-    for (unsigned int j = 0; j < rect.width; j++) {
-      // intensity is from 0 - 30, evens only
-      buffer[j + i*rect.width] = uint8_t(to_float(SHARED_MEM[j+rect.left + (i+rect.top)*WIDTH]) * 15) * 2;
-    }
+  if (verbosity >= 2) {
+    std::cerr << "Dirty Region: " << rect.left << " " << rect.top << " "
+              << rect.width << " " << rect.height << std::endl;
   }
 
-
   // There are three update modes on the rm2. But they are mapped to the five
   // rm1 modes as follows:
   //
@@ -72,11 +80,17 @@ void do_update(Waved::Display &display, const swtfb::swtfb_update &s) {
   // correctly handle the corresponding ioctl (empty rect and flags == 2?).
   if (waveform == /*init*/ 0 && update_mode == /* full */ 1) {
     flags |= 2;
-    std::cerr << "SERVER: sync" << std::endl;
+
+    if (verbosity >= 2) {
+      std::cerr << "SERVER: sync" << std::endl;
+    }
   } else if (rect.left == 0 && rect.top > 1800 &&
              waveform == /* grayscale */ 3 && update_mode == /* full */ 1) {
-    std::cerr << "server sync, x2: " << rect.width << " y2: " << rect.height
-              << std::endl;
+    if (verbosity >= 2) {
+      std::cerr << "server sync, x2: " << rect.width << " y2: " << rect.height
+                << std::endl;
+    }
+
     flags |= 2;
   }
 
@@ -85,31 +99,199 @@ void do_update(Waved::Display &display, const swtfb::swtfb_update &s) {
     flags = 4;
   }
 
-#ifdef DEBUG
-  std::cerr << "do_update " << std::endl;
-  std::cerr << "mxc: waveform_mode " << mxcfb_update.waveform_mode << std::endl;
-  std::cerr << "mxc: update mode " << mxcfb_update.update_mode << std::endl;
-  std::cerr << "mxc: update marker " << mxcfb_update.update_marker << std::endl;
-  std::cerr << "final: waveform " << waveform;
-  std::cerr << " flags " << flags << std::endl << std::endl;
-#endif
+  if (verbosity >= 2) {
+    std::cerr << "do_update " << std::endl;
+    std::cerr << "mxc: waveform_mode " << mxcfb_update.waveform_mode << std::endl;
+    std::cerr << "mxc: update mode " << mxcfb_update.update_mode << std::endl;
+    std::cerr << "mxc: update marker " << mxcfb_update.update_marker << std::endl;
+    std::cerr << "final: waveform " << waveform;
+    std::cerr << " flags " << flags << std::endl << std::endl;
+  }
 
   Waved::Region region;
   region.top = rect.top;
   region.left = rect.left;
   region.width = rect.width;
   region.height = rect.height;
+  return {waveform, region, update_mode == /* full */ 1};
+}
 
-  display.push_update(
-    waveform,
-    region,
-    buffer
-  );
+bool on_screen(const Waved::Region &region) {
+  return region.left < WIDTH && region.top < HEIGHT
+    && region.width <= WIDTH - region.left
+    && region.height <= HEIGHT - region.top;
+}
 
+bool overlaps(const Waved::Region &a, const Waved::Region &b) {
+  return a.left < b.left + b.width && b.left < a.left + a.width
+    && a.top < b.top + b.height && b.top < a.top + a.height;
+}
+
+// Add an update to a batch. Since pixels are only read from SHARED_MEM
+// when the batch is sent, an update that overlaps an earlier one with the
+// same waveform can be merged into it, as long as the merged rectangle
+// does not cover any later update, whose order would otherwise change
+void add_to_batch(std::vector<PendingUpdate> &batch, PendingUpdate update) {
+  if (on_screen(update.region)) {
+    for (std::size_t i = batch.size(); i-- > 0;) {
+      const auto &region = batch[i].region;
+
+      if (!overlaps(region, update.region)) {
+        continue;
+      }
+
+      if (batch[i].waveform != update.waveform || !on_screen(region)) {
+        break;
+      }
+
+      Waved::Region merged;
+      merged.left = std::min(region.left, update.region.left);
+      merged.top = std::min(region.top, update.region.top);
+      merged.width = std::max(
+        region.left + region.width, update.region.left + update.region.width
+      ) - merged.left;
+      merged.height = std::max(
+        region.top + region.height, update.region.top + update.region.height
+      ) - merged.top;
+
+      for (std::size_t j = i + 1; j < batch.size(); ++j) {
+        if (overlaps(batch[j].region, merged)) {
+          batch.push_back(update);
+          return;
+        }
+      }
+
+      batch[i].region = merged;
+      return;
+    }
+  }
+
+  batch.push_back(update);
+}
+
+// Add an update to a batch, leaving out the parts of partial updates
+// whose pixels are the same as when they were last sent
+void add_changes_to_batch(
+  Shadow &shadow,
+  std::vector<PendingUpdate> &batch,
+  PendingUpdate update
+) {
+  if (!on_screen(update.region)) {
+    add_to_batch(batch, update);
+    return;
+  }
+
+  auto changes = shadow.update(update.region);
+
+  if (update.full) {
+    add_to_batch(batch, update);
+    return;
+  }
+
+  if (verbosity >= 2) {
+    std::cerr << "Changed parts: " << changes.size() << std::endl;
+  }
+
+  for (const auto &region : changes) {
+    add_to_batch(batch, {update.waveform, region, false});
+  }
+}
+
+// Send the updates of a batch to the display
+void send_batch(
+  Waved::Display &display,
+  Shadow &shadow,
+  std::vector<PendingUpdate> &batch,
+  Waiters &waiters
+) {
+  for (const auto &update : batch) {
+    // The RGB565 pixels are converted while being read from SHARED_MEM.
+    // Rectangles outside of the screen, which has the same bounds as
+    // SHARED_MEM, are rejected before reading anything
+    auto id = display.push_update(
+      update.waveform,
+      update.region,
+      SHARED_MEM + update.region.left + update.region.top * WIDTH,
+      WIDTH * sizeof(uint16_t),
+      Waved::PixelFormat::RGB565
+    );
+
+    if (id) {
+      waiters.add(*id);
+    } else if (on_screen(update.region)) {
+      // Make sure the region is sent again next time
+      shadow.invalidate(update.region);
+    }
+  }
+
+  batch.clear();
+}
+
+// Power on the display ahead of time when the pen gets close to the screen,
+// since drawing is likely to follow
+void watch_pen(Waved::Display &display) {
+  int fd = -1;
+
+  for (int i = 0; i < 8 && fd == -1; ++i) {
+    auto path = "/dev/input/event" + std::to_string(i);
+    fd = open(path.data(), O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+      continue;
+    }
+
+    char name[64] = {};
+    ioctl(fd, EVIOCGNAME(sizeof(name) - 1), name);
+
+    if (std::strstr(name, "Wacom") == nullptr) {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  if (fd == -1) {
+    std::cerr << "[init] Cannot find pen input device\n";
+    return;
+  }
+
+  input_event event;
+
+  while (read(fd, &event, sizeof(event)) == sizeof(event)) {
+    if (event.type == EV_KEY && event.code == BTN_TOOL_PEN && event.value == 1) {
+      display.hint_activity();
+    }
+  }
+
+  close(fd);
+}
+
+// Append the performance report to a file every second, for diagnosing
+// latency issues without a special build
+void save_perf_report(Waved::Display &display, std::string path) {
+  std::ofstream out{path, std::ios::app};
+
+  if (!out) {
+    std::cerr << "[init] Cannot open performance report file " << path << '\n';
+    return;
+  }
+
+  std::cerr << "[init] Saving performance report to " << path << '\n';
+  display.set_tracing(true);
+  bool header = out.tellp() == 0;
+
+  while (out) {
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    out << display.get_perf_report(header) << std::flush;
+    header = false;
+  }
 }
 
 int main(int, const char**)
 {
+    if (const char* level = std::getenv("WAVED_VERBOSITY")) {
+        verbosity = std::atoi(level);
+    }
+
     auto wbf_path = Waved::WaveformTable::discover_wbf_file();
 
     if (!wbf_path) {
@@ -119,7 +301,21 @@ int main(int, const char**)
         std::cerr << "[init] Using waveform file: " << *wbf_path << '\n';
     }
 
-    auto table = Waved::WaveformTable::from_wbf(wbf_path->data());
+    auto cache_path = Waved::WaveformTable::discover_cache_file(
+        wbf_path->data()
+    );
+    Waved::WaveformTable table;
+
+    if (cache_path) {
+        std::cerr << "[init] Using waveform cache: " << *cache_path << '\n';
+        table = Waved::WaveformTable::from_wbf(
+            wbf_path->data(),
+            cache_path->data()
+        );
+    } else {
+        table = Waved::WaveformTable::from_wbf(wbf_path->data());
+    }
+
     auto framebuffer_path = Waved::Display::discover_framebuffer();
 
     if (!framebuffer_path) {
@@ -146,34 +342,81 @@ int main(int, const char**)
         std::move(table),
     };
 
+    // Pushed updates not yet displayed and clients waiting for them
+    Waiters waiters;
+    display.set_completion_callback([&waiters](auto id) {
+        waiters.complete(id);
+    });
+
+    if (const char* dithering = std::getenv("WAVED_DITHERING")) {
+        display.set_dithering(std::atoi(dithering) != 0);
+    }
+
     display.start();
+    std::thread(watch_pen, std::ref(display)).detach();
+
+    if (const char* perf_path = std::getenv("WAVED_PERF_REPORT")) {
+        std::thread(save_perf_report, std::ref(display), perf_path).detach();
+    }
 
   SHARED_MEM = swtfb::ipc::get_shared_buffer();
+
+  // Contents of SHARED_MEM last sent to the display
+  Shadow shadow(SHARED_MEM, WIDTH, HEIGHT);
+
+  // Messages received in the current batch
+  std::vector<swtfb::swtfb_update> messages;
+  messages.reserve(max_batch);
+
+  // Updates of the current batch not yet sent to the display
+  std::vector<PendingUpdate> batch;
+
   while (true) {
-    auto buf = MSGQ.recv();
-    switch (buf.mtype) {
-    case swtfb::ipc::UPDATE_t: {
-			std::cerr << "HANDLING UPDATE\n";
-      do_update(display, buf);
-    } break;
-    case swtfb::ipc::XO_t: {
-      // XO_t means that buf.xochitl_update is filled in and needs to be forwarded to xochitl or translated
-      // to a compatible format with waved server
-			std::cerr << "HANDLING XO_t\n";
-    } break;
-    case swtfb::ipc::WAIT_t: {
-			std::cerr << "HANDLING WAIT\n";
-      break;
-//      fb.WaitForLastUpdate();
-      sem_t* sem = sem_open(buf.mdata.wait_update.sem_name, O_CREAT, 0644, 0);
-      if (sem != NULL) {
-        sem_post(sem);
-        sem_close(sem);
+    // Wait for a message, then take the ones queued behind it so that
+    // updates requested in quick succession are sent together
+    messages.resize(1);
+    messages[0] = MSGQ.recv();
+
+    while (messages.size() < max_batch) {
+      messages.emplace_back();
+
+      if (!MSGQ.try_recv(messages.back())) {
+        messages.pop_back();
+        break;
       }
-    } break;
+    }
 
-    default:
-      std::cerr << "Error, unknown message type" << std::endl;
+    if (verbosity >= 2) {
+      std::cerr << "Handling " << messages.size() << " messages\n";
     }
+
+    for (const auto &buf : messages) {
+      switch (buf.mtype) {
+      case swtfb::ipc::UPDATE_t:
+        add_changes_to_batch(shadow, batch, parse_update(buf));
+        break;
+
+      case swtfb::ipc::XO_t:
+        // XO_t means that buf.xochitl_update is filled in and needs to be
+        // forwarded to xochitl or translated to a compatible format with
+        // waved server
+        if (verbosity >= 2) {
+          std::cerr << "Ignoring XO_t message\n";
+        }
+        break;
+
+      case swtfb::ipc::WAIT_t: {
+        // Release the client once all its updates are displayed, without
+        // holding up the messages of other clients
+        send_batch(display, shadow, batch, waiters);
+        waiters.wait(buf.mdata.wait_update.sem_name);
+      } break;
+
+      default:
+        std::cerr << "Error, unknown message type" << std::endl;
+      }
+    }
+
+    send_batch(display, shadow, batch, waiters);
   }
 }
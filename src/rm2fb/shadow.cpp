@@ -0,0 +1,174 @@
+/**
+ * @file Track which parts of the shared framebuffer changed between updates.
+ * SPDX-FileCopyrightText: 2021-2022 Mattéo Delabre <git.matteo@delab.re>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "shadow.hpp"
+#include <algorithm>
+#include <cstring>
+
+Shadow::Shadow(
+    const std::uint16_t* buffer,
+    std::uint32_t width,
+    std::uint32_t height
+)
+: buffer(buffer)
+, width(width)
+, height(height)
+, block_columns((width + block_size - 1) / block_size)
+, block_rows((height + block_size - 1) / block_size)
+, copy(buffer, buffer + width * height)
+, known(block_columns * block_rows, false)
+{}
+
+auto Shadow::get_blocks(const Waved::Region& region) const -> Waved::Region
+{
+    if (region.width == 0 || region.height == 0) {
+        return Waved::Region{0, 0, 0, 0};
+    }
+
+    const auto top = region.top / block_size;
+    const auto left = region.left / block_size;
+    return Waved::Region{
+        top, left,
+        (region.left + region.width - 1) / block_size + 1 - left,
+        (region.top + region.height - 1) / block_size + 1 - top
+    };
+}
+
+auto Shadow::update(const Waved::Region& region)
+-> std::vector<Waved::Region>
+{
+    const auto blocks = this->get_blocks(region);
+    const auto region_right = region.left + region.width;
+    const auto region_bottom = region.top + region.height;
+
+    // Rectangles of changed blocks, in block coordinates. Runs of changed
+    // blocks on successive rows that span the same columns are joined, so
+    // that the rectangles ending on the previous row are kept apart
+    std::vector<Waved::Region> closed;
+    std::vector<Waved::Region> open;
+    std::vector<Waved::Region> next_open;
+
+    const auto end_run = [&](
+        std::uint32_t row,
+        std::uint32_t left,
+        std::uint32_t right
+    ) {
+        auto joined = std::find_if(
+            open.begin(), open.end(),
+            [left, right](const Waved::Region& rect) {
+                return rect.left == left && rect.width == right - left;
+            }
+        );
+
+        if (joined != open.end()) {
+            ++joined->height;
+            next_open.push_back(*joined);
+            open.erase(joined);
+        } else {
+            next_open.push_back(Waved::Region{row, left, right - left, 1});
+        }
+    };
+
+    for (auto row = blocks.top; row < blocks.top + blocks.height; ++row) {
+        const auto top = std::max(row * block_size, region.top);
+        const auto bottom = std::min((row + 1) * block_size, region_bottom);
+        const bool full_height = top == row * block_size
+            && bottom == std::min((row + 1) * block_size, this->height);
+        std::uint32_t run_start = 0;
+        bool in_run = false;
+
+        for (
+            auto column = blocks.left;
+            column < blocks.left + blocks.width;
+            ++column
+        ) {
+            const auto left = std::max(column * block_size, region.left);
+            const auto right = std::min((column + 1) * block_size, region_right);
+            const auto size = (right - left) * sizeof(std::uint16_t);
+            const auto index = row * this->block_columns + column;
+            bool changed = !this->known[index];
+
+            for (auto y = top; y < bottom; ++y) {
+                const auto offset = y * this->width + left;
+
+                // memcmp() uses the widest vector compares available
+                if (
+                    changed
+                    || std::memcmp(
+                        this->buffer + offset,
+                        this->copy.data() + offset,
+                        size
+                    ) != 0
+                ) {
+                    std::memcpy(
+                        this->copy.data() + offset,
+                        this->buffer + offset,
+                        size
+                    );
+                    changed = true;
+                }
+            }
+
+            if (
+                full_height
+                && left == column * block_size
+                && right == std::min((column + 1) * block_size, this->width)
+            ) {
+                this->known[index] = true;
+            }
+
+            if (changed && !in_run) {
+                run_start = column;
+                in_run = true;
+            } else if (!changed && in_run) {
+                end_run(row, run_start, column);
+                in_run = false;
+            }
+        }
+
+        if (in_run) {
+            end_run(row, run_start, blocks.left + blocks.width);
+        }
+
+        closed.insert(closed.end(), open.cbegin(), open.cend());
+        open.swap(next_open);
+        next_open.clear();
+    }
+
+    closed.insert(closed.end(), open.cbegin(), open.cend());
+
+    // Convert to pixel coordinates
+    for (auto& rect : closed) {
+        const auto top = std::max(rect.top * block_size, region.top);
+        const auto left = std::max(rect.left * block_size, region.left);
+        const auto bottom = std::min(
+            (rect.top + rect.height) * block_size,
+            region_bottom
+        );
+        const auto right = std::min(
+            (rect.left + rect.width) * block_size,
+            region_right
+        );
+        rect = Waved::Region{top, left, right - left, bottom - top};
+    }
+
+    return closed;
+}
+
+void Shadow::invalidate(const Waved::Region& region)
+{
+    const auto blocks = this->get_blocks(region);
+
+    for (auto row = blocks.top; row < blocks.top + blocks.height; ++row) {
+        for (
+            auto column = blocks.left;
+            column < blocks.left + blocks.width;
+            ++column
+        ) {
+            this->known[row * this->block_columns + column] = false;
+        }
+    }
+}
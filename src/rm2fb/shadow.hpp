@@ -0,0 +1,75 @@
+/**
+ * @file Track which parts of the shared framebuffer changed between updates.
+ * SPDX-FileCopyrightText: 2021-2022 Mattéo Delabre <git.matteo@delab.re>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef WAVED_RM2FB_SHADOW_HPP
+#define WAVED_RM2FB_SHADOW_HPP
+
+#include "defs.hpp"
+#include <cstdint>
+#include <vector>
+
+/**
+ * Copy of the shared framebuffer contents last sent to the display.
+ *
+ * Clients draw into the shared framebuffer in place and often request
+ * updates for rectangles much larger than what they changed. Comparing
+ * the framebuffer against this copy, block by block, gives the parts of
+ * a rectangle that actually need to be displayed.
+ *
+ * Blocks start out unknown, since the screen contents when the server
+ * starts are not known, and are always considered changed until their
+ * contents have been sent as a whole.
+ */
+class Shadow
+{
+public:
+    /**
+     * Create a copy of a framebuffer.
+     *
+     * @param buffer Framebuffer to track, in RGB565 format.
+     * @param width Number of pixels per framebuffer row.
+     * @param height Number of framebuffer rows.
+     */
+    Shadow(const std::uint16_t* buffer, std::uint32_t width, std::uint32_t height);
+
+    /**
+     * Record the contents of a rectangle as being sent to the display.
+     *
+     * @param region Rectangle to send, within the framebuffer bounds.
+     * @return Rectangles covering the blocks of the region whose contents
+     * changed since they were last sent, clipped to the region.
+     */
+    std::vector<Waved::Region> update(const Waved::Region& region);
+
+    /**
+     * Forget the contents of a rectangle, for example because it could
+     * not be sent to the display.
+     *
+     * @param region Rectangle to forget, within the framebuffer bounds.
+     */
+    void invalidate(const Waved::Region& region);
+
+private:
+    // Size of the square blocks in which the framebuffer is compared
+    static constexpr std::uint32_t block_size = 32;
+
+    const std::uint16_t* buffer;
+    std::uint32_t width;
+    std::uint32_t height;
+    std::uint32_t block_columns;
+    std::uint32_t block_rows;
+
+    // Contents last sent for each pixel
+    std::vector<std::uint16_t> copy;
+
+    // Whether the copy holds the contents last sent for a whole block
+    std::vector<bool> known;
+
+    /** Get the range of blocks covering a rectangle. */
+    Waved::Region get_blocks(const Waved::Region& region) const;
+};
+
+#endif // WAVED_RM2FB_SHADOW_HPP
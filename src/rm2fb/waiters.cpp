@@ -0,0 +1,65 @@
+/**
+ * @file Release clients waiting for their updates to be displayed.
+ * SPDX-FileCopyrightText: 2021-2022 Mattéo Delabre <git.matteo@delab.re>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "waiters.hpp"
+#include <fcntl.h>
+
+void Waiters::add(UpdateID id)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->last = id;
+    this->any = true;
+
+    if (this->early.erase(id) == 0) {
+        this->outstanding.insert(id);
+    }
+}
+
+void Waiters::complete(UpdateID id)
+{
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    if (this->outstanding.erase(id) == 0) {
+        this->early.insert(id);
+    }
+
+    this->release();
+}
+
+void Waiters::wait(const char* sem_name)
+{
+    sem_t* sem = sem_open(sem_name, O_CREAT, 0644, 0);
+
+    if (sem == SEM_FAILED) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    if (!this->any) {
+        sem_post(sem);
+        sem_close(sem);
+        return;
+    }
+
+    this->waiters.push_back(Waiter{this->last, sem});
+    this->release();
+}
+
+void Waiters::release()
+{
+    while (
+        !this->waiters.empty()
+        && (
+            this->outstanding.empty()
+            || *this->outstanding.begin() > this->waiters.front().last
+        )
+    ) {
+        sem_post(this->waiters.front().sem);
+        sem_close(this->waiters.front().sem);
+        this->waiters.pop_front();
+    }
+}
@@ -0,0 +1,84 @@
+/**
+ * @file Release clients waiting for their updates to be displayed.
+ * SPDX-FileCopyrightText: 2021-2022 Mattéo Delabre <git.matteo@delab.re>
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef WAVED_RM2FB_WAITERS_HPP
+#define WAVED_RM2FB_WAITERS_HPP
+
+#include "display.hpp"
+#include <semaphore.h>
+#include <deque>
+#include <mutex>
+#include <set>
+
+/**
+ * Set of updates not yet displayed and of clients waiting for them.
+ *
+ * Updates are tracked from the display's completion callback, so that
+ * waiting never blocks the message loop and updates that no client waits
+ * for are forgotten as soon as they are displayed.
+ */
+class Waiters
+{
+public:
+    using UpdateID = Waved::Display::UpdateID;
+
+    /**
+     * Record an update pushed to the display.
+     *
+     * @param id ID returned by `push_update()`.
+     */
+    void add(UpdateID id);
+
+    /**
+     * Record an update as displayed and release the clients whose updates
+     * are now all displayed. Meant to be used as the display's completion
+     * callback.
+     *
+     * @param id ID of the displayed update.
+     */
+    void complete(UpdateID id);
+
+    /**
+     * Post a client semaphore once all updates pushed so far are displayed.
+     *
+     * @param sem_name Name of the semaphore to post.
+     */
+    void wait(const char* sem_name);
+
+private:
+    // Client waiting for all updates up to a given ID
+    struct Waiter
+    {
+        UpdateID last;
+        sem_t* sem;
+    };
+
+    // Lock protecting the fields below, which are used both from the
+    // message loop and from the display's completion callback
+    std::mutex lock;
+
+    // Pushed updates not yet displayed
+    std::set<UpdateID> outstanding;
+
+    // Updates displayed before their ID was recorded with `add()`, which
+    // can happen for updates that leave the display unchanged
+    std::set<UpdateID> early;
+
+    // ID of the last recorded update, if any
+    UpdateID last = 0;
+    bool any = false;
+
+    // Waiting clients, in increasing order of their last update
+    std::deque<Waiter> waiters;
+
+    /**
+     * Post the semaphores of clients whose updates are all displayed.
+     * This assumes that a lock on `lock` is already held.
+     */
+    void release();
+};
+
+#endif // WAVED_RM2FB_WAITERS_HPP